@@ -6,6 +6,8 @@
 //
 // INCLUDED FILES
 //
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,62 +15,702 @@
 //
 // LOCAL DEFINITIONS, MACROS, AND TYPEDEFS
 //
-#define NXPRAM_FIRST512_ADDRESS (268435968)
-#define NXPRAM_SECOND512_ADDRESS (268436480)
+// RAM staging area for the C command, 10000200h up to one 32 KB sector
+#define NXPRAM_STAGING_ADDRESS (268435968)
+// one block of FFh above it, blank blocks are compared against it
+#define NXPRAM_BLANK_ADDRESS (NXPRAM_STAGING_ADDRESS + 32768)
+// image writes may land anywhere in the 512 KB of flash
 #define NXPFLASH_BEGIN_ADDRESS (0)
-#define NXPFLASH_END_ADDRESS (44032)
+#define NXPFLASH_END_ADDRESS (524288)
 #define FIRST_SECTOR (0)
 #define MAX_SECTOR (29)
 
+// LPC1788 sectors 0-15 are 4 KB, 16-29 are 32 KB
+#define SMALL_SECTOR_SIZE (4096)
+#define LARGE_SECTOR_SIZE (32768)
+
 #define HANDSHANKING_START_MSG ("?")
 #define HANDSHAKING_SYN_MSG ("Synchronized")
 #define HANDSHAKING_ACK_MSG ("0")
 
-#define VERSION_CHECK_CMD ("J")
 #define VERSION_LEN (10)
-#define PREPARE_SECTOR_CMD ("P %d %d")
-#define ERASE_SECTOR_CMD ("E %d %d")
-#define UNLOCK_CMD ("U 23130")
-#define WRITE_FIRST_RAM_BLOCK ("W 268435968 512")
-#define WRITE_SECOND_RAM_BLOCK ("W 268436480 512")
-#define COPY_FROM_RAM_TO_FLASH ("C %d 268435968 1024")
+#define ISP_UNLOCK_CODE (23130)
 
 #define RESPONSE_ZERO ("0")
 #define RESPONSE_OK	("OK")
 #define RESPONSE_SYN ("Synchronized")
+#define RESPONSE_RESEND ("RESEND")
+
+// digits of the largest uint32_t
+#define ISP_DECIMAL_MAX (10)
 
 #define ISP_RAM_WRITE_MAX (512)
-#define ISP_FLASH_COPY_MAX (1024)
+#define ISP_FLASH_COPY_MAX (4096)
 
-#define UART_RECV_BUFFER_SIZE (100)
+// R sends its checksum after every 20 uuencode lines and after the last one
+#define ISP_READ_LINES (20)
 
 #define NXP_CMD_MAX_LENGTH (64)
 
+// longest response line kept, a command echo or a uuencode line. Longer
+// lines are counted but never match.
+#define ISP_LINE_MAX (NXP_CMD_MAX_LENGTH)
+
 #define UUENCODE_MAX_BYTES (45)
 
 #define UUENCODE_OFFSET (0x20)
 
-#define BUFFER_SIZE (1024)
+// uudecodeTable entry of a char outside the uuencode alphabet
+#define UUDECODE_BAD (0x40)
+
+// length char + 4 chars per 3 bytes
+#define UUENCODE_LINE_MAX (1 + (UUENCODE_MAX_BYTES / 3) * 4)
+
+#define UUENCODE_LINES_MAX \
+	((ISP_RAM_WRITE_MAX + UUENCODE_MAX_BYTES - 1) / UUENCODE_MAX_BYTES)
+
+// 1: low RAM build, for a bridge sharing its RAM with heavy CAN traffic.
+// byteBuffer holds one W block, the uuencode lines are encoded one at a time
+// from it as they go out and a RESEND encodes it again, the UART rings are
+// small and compressed writes are refused. The footprint stats record
+// reports what those buffers take in a build.
+#ifndef NXP_LOW_RAM_ENABLE
+#define NXP_LOW_RAM_ENABLE (0)
+#endif
+
+// bytes committed to flash per C command: 256, 512, 1024 or 4096
+#ifndef NXP_COPY_SIZE
+#if NXP_LOW_RAM_ENABLE
+#define NXP_COPY_SIZE (ISP_RAM_WRITE_MAX)
+#else
+#define NXP_COPY_SIZE (1024)
+#endif
+#endif
+
+#if (NXP_COPY_SIZE != 256) && (NXP_COPY_SIZE != 512) \
+	&& (NXP_COPY_SIZE != 1024) && (NXP_COPY_SIZE != 4096)
+#error "NXP_COPY_SIZE must be 256, 512, 1024 or 4096"
+#endif
+
+// bytes sent per W command
+#if NXP_COPY_SIZE < ISP_RAM_WRITE_MAX
+#define NXP_RAM_WRITE_SIZE (NXP_COPY_SIZE)
+#else
+#define NXP_RAM_WRITE_SIZE (ISP_RAM_WRITE_MAX)
+#endif
+
+#define BUFFER_SIZE (NXP_COPY_SIZE)
+
+// 1: turn echo off once per session and stream uuencode lines back to back,
+// integrity is only checked at the checksum response
+#ifndef NXP_STREAMING_ENABLE
+#define NXP_STREAMING_ENABLE (1)
+#endif
+
+// times a 512 bytes RAM block is resent on a checksum failure
+#ifndef ISP_RESEND_MAX
+#define ISP_RESEND_MAX (3)
+#endif
+
+// rate the UART and the NXP boot ROM start at
+#ifndef NXP_BAUD_DEFAULT
+#define NXP_BAUD_DEFAULT (115200)
+#endif
+
+// ? is sent again until the boot ROM answers. The first wait is as long as
+// the last sync took, each one after that twice as long up to
+// HANDSHAKE_RETRY_MAX_MS, HANDSHAKE_BUDGET_MS in all.
+#ifndef HANDSHAKE_RETRY_MIN_MS
+#define HANDSHAKE_RETRY_MIN_MS (2)
+#endif
+#ifndef HANDSHAKE_RETRY_MAX_MS
+#define HANDSHAKE_RETRY_MAX_MS (50)
+#endif
+#ifndef HANDSHAKE_BUDGET_MS
+#define HANDSHAKE_BUDGET_MS (1000)
+#endif
+
+// RESET is held low this long, well over the pulse the NXP's reset filter
+// and the RC on the line need
+#ifndef NXP_RESET_HOLD_MS
+#define NXP_RESET_HOLD_MS (1)
+#endif
+
+// 1: a prepare finding the NXP still in ISP mode from the last job skips
+// the reset, the sync, J and B
+#ifndef NXP_WARM_SESSION_ENABLE
+#define NXP_WARM_SESSION_ENABLE (1)
+#endif
+
+// 1: after the handshake try the rates in baudRates, fastest first
+#ifndef NXP_BAUD_UPGRADE_ENABLE
+#define NXP_BAUD_UPGRADE_ENABLE (1)
+#endif
+
+#ifndef NXP_STOP_BITS
+#define NXP_STOP_BITS (1)
+#endif
+
+// 1: erase a sector only when one of its blocks differs from the image
+#ifndef NXP_DIFFERENTIAL_ENABLE
+#define NXP_DIFFERENTIAL_ENABLE (1)
+#endif
+
+// 1: compare every block with its RAM copy after the C command and program
+// the sector again from RAM on a mismatch
+#ifndef NXP_VERIFY_ENABLE
+#define NXP_VERIFY_ENABLE (1)
+#endif
+
+// times a sector is erased and programmed again for one bad block
+#ifndef NXP_RECOMMIT_MAX
+#define NXP_RECOMMIT_MAX (2)
+#endif
+
+// the boot ROM maps its own vectors over the start of sector 0, flash there
+// never compares equal
+#define BOOT_VECTOR_SIZE (64)
+
+// 1: count and time every ISP command, read back with handleNXPDisplayStats
+#ifndef NXP_STATS_ENABLE
+#define NXP_STATS_ENABLE (1)
+#endif
+
+// a deeper stack than this is from a call outside any handler, not counted
+#ifndef NXP_STACK_DEPTH_MAX
+#define NXP_STACK_DEPTH_MAX (65536)
+#endif
+
+// free running cycle counter, the PMU cycle counter must be started
+#ifndef NXP_CYCLE_COUNT
+#define NXP_CYCLE_COUNT() _pmuGetCycleCount_()
+#endif
+
+#ifndef NXP_CPU_HZ
+#define NXP_CPU_HZ (180000000)
+#endif
+
+// SCI port wired to the NXP ISP UART, driven in interrupt mode
+#ifndef NXP_SCI_PORT
+#define NXP_SCI_PORT (scilinREG)
+#endif
+
+// UART rings, powers of two. A full TX ring holds more than one W block of
+// uuencode lines so the next block can be encoded while this one goes out,
+// a low RAM one a few lines.
+#ifndef UART_TX_RING_SIZE
+#if NXP_LOW_RAM_ENABLE
+#define UART_TX_RING_SIZE (256)
+#define UART_RX_RING_SIZE (256)
+#else
+#define UART_TX_RING_SIZE (2048)
+#define UART_RX_RING_SIZE (512)
+#endif
+#endif
+
+#if ((UART_TX_RING_SIZE & (UART_TX_RING_SIZE - 1)) != 0) \
+		|| ((UART_RX_RING_SIZE & (UART_RX_RING_SIZE - 1)) != 0)
+#error "UART ring sizes must be powers of two"
+#endif
+
+// a response not complete after this long has timed out, with adaptive
+// deadlines the most a command that does no flash work waits
+#ifndef NXP_UART_TIMEOUT_MS
+#define NXP_UART_TIMEOUT_MS (100)
+#endif
+#define NXP_MS_CYCLES(ms) ((NXP_CPU_HZ / 1000) * (ms))
+#define NXP_US_CYCLES(us) ((NXP_CPU_HZ / 1000000) * (us))
+#define NXP_UART_TIMEOUT_CYCLES (NXP_MS_CYCLES(NXP_UART_TIMEOUT_MS))
+
+// 1: wait for each response line only as long as its command should take,
+// see NXPIspLineTimeout. 0: NXP_UART_TIMEOUT_MS for every line, plus the
+// seeded allowance of the flash work an E, C or M command does.
+#ifndef NXP_ADAPTIVE_DEADLINE_ENABLE
+#define NXP_ADAPTIVE_DEADLINE_ENABLE (1)
+#endif
+
+// shortest wait for a line, a few RTI ticks
+#ifndef NXP_DEADLINE_MIN_MS
+#define NXP_DEADLINE_MIN_MS (5)
+#endif
+
+// LPC1788 sector erase and 256 bytes program times from the datasheet, the
+// deadlines start from these until the NXP has been timed
+#ifndef NXP_ERASE_SECTOR_MS
+#define NXP_ERASE_SECTOR_MS (100)
+#endif
+#ifndef NXP_PROGRAM_256_US
+#define NXP_PROGRAM_256_US (1000)
+#endif
+#ifndef NXP_COMPARE_256_US
+#define NXP_COMPARE_256_US (100)
+#endif
+
+// sleep until the next interrupt while the rings are full or empty, the RTI
+// tick wakes the CPU up for timeouts
+#ifndef NXP_UART_WAIT
+#define NXP_UART_WAIT() asm(" WFI")
+#endif
+
+// run before each of those sleeps. Point it at the bridge's CAN service to
+// keep other CAN traffic answered through a whole reflash, NXP requests it
+// hands back in are refused with CMD_POB_REJ until the outer one returns.
+#ifndef NXP_IDLE_HOOK
+#define NXP_IDLE_HOOK()
+#endif
+
+// where dumped flash goes, the CAN layer queues every piece for the host with
+// its address as it comes, see handleNXPDisplayRead
+#ifndef NXP_DUMP_OUTPUT
+#define NXP_DUMP_OUTPUT(addr, data, len) canDumpOutput(addr, data, len)
+#endif
+
+// 1: take compressed writes, see handleNXPDisplayWriteCompressed
+#ifndef NXP_LZ_ENABLE
+#define NXP_LZ_ENABLE (!NXP_LOW_RAM_ENABLE)
+#endif
+
+// The window is fixed by the 10 bits distance of the match token.
+#define LZ_WINDOW_SIZE (1024)
+#define LZ_LITERAL_MAX (0x80)
+#define LZ_MATCH_MIN (3)
+// match length field all ones, one more byte of length follows
+#define LZ_LENGTH_EXTEND (LZ_MATCH_MIN + 31)
+
+#ifndef NXP_IRQ_DISABLE
+#define NXP_IRQ_DISABLE() _disable_IRQ()
+#define NXP_IRQ_ENABLE() _enable_IRQ()
+#endif
 
 //Index into CAN data
 #define START_ADDR_INDEX	0
 #define SIZE_BYTES_INDEX	4
 #define DATA_INDEX			8
 
+#define STATS_RECORD_INDEX	0
+#define STATS_CLEAR_INDEX	1
+
+#define RESUME_ID_INDEX		0
+
+//Index into response data
+#define RSP_BAUD_INDEX		0
+#define RSP_CRC_INDEX		0
+#define RSP_IMAGE_SIZE_INDEX	4
+#define RSP_RESUME_ADDR_INDEX	4
+#define RSP_RESUME_CRC_INDEX	8
+#define RSP_RESUME_BYTES_INDEX	12
+#define RSP_READ_SIZE_INDEX	4
+
 // handshaking state machine
 typedef enum {
 	HANDSHAKING_START, HANDSHAKING_SYN, HANDSHAKING_ACK, HANDSHAKING_SUCCESSFUL
 } HandShakingStatus_t;
 
-// RAM buffer
-static uint8_t byteBuffer[BUFFER_SIZE + 5];
+// one W block encoded in uuencode lines, ready to send
+typedef struct {
+	uint8_t line[UUENCODE_LINES_MAX][UUENCODE_LINE_MAX + 1];
+	uint8_t lineLen[UUENCODE_LINES_MAX];
+	uint32_t lineCount;
+	uint32_t chksum;
+} UUEncodeBlock_t;
+
+// one W block uuencoded ahead of time on the host, its lines back to back
+// each ending in CR
+typedef struct {
+	const uint8_t *text;
+	uint32_t len;
+	uint32_t chksum;
+} NXPEncodedBlock_t;
+
+// blocks of one sector that can be staged in NXP RAM at a time
+#define RAM_STAGED_BLOCKS (LARGE_SECTOR_SIZE / NXP_COPY_SIZE)
+#define RAM_STAGED_WORDS ((RAM_STAGED_BLOCKS + 31) / 32)
+
+// no sector prepared / staged
+#define SECTOR_NONE (MAX_SECTOR + 1)
+
+// flash sector layout
+typedef struct {
+	uint32_t start;
+	uint32_t size;
+} SectorGeometry_t;
+
+// erase state of each flash sector in this session
+typedef enum {
+	SECTOR_UNCHECKED, SECTOR_MATCHED, SECTOR_ERASED
+} SectorState_t;
+
+// what the NXP is known to hold in this session, commands that would not
+// change it are not sent
+typedef struct {
+	uint8_t echoEnabled;
+	uint8_t unlocked;
+	// synced and left in ISP command mode at baudRate
+	uint8_t synced;
+	uint32_t preparedFirst;
+	uint32_t preparedLast;
+	uint32_t ramSector;
+	uint32_t ramStaged[RAM_STAGED_WORDS];
+	// bytes of FFh at NXPRAM_BLANK_ADDRESS
+	uint32_t blankStaged;
+} NXPSession_t;
+
+// bytes for the NXP, drained by the SCI TX interrupt. head and tail run
+// free and are masked on access
+typedef struct {
+	uint8_t data[UART_TX_RING_SIZE];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	// bytes handed to sciSend and not yet sent
+	volatile uint32_t busy;
+} UartTxRing_t;
+
+// bytes from the NXP, filled by the SCI RX interrupt
+typedef struct {
+	uint8_t data[UART_RX_RING_SIZE];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t overruns;
+	// sciReceive lands each byte here
+	uint8_t byte;
+	uint8_t armed;
+} UartRxRing_t;
+
+// compressed write decoder, tokens may span CAN chunks
+typedef enum {
+	LZ_CONTROL, LZ_LITERAL, LZ_DISTANCE, LZ_EXTEND
+} LzState_t;
+
+typedef struct {
+#if NXP_LZ_ENABLE
+	// last bytes decoded, pos runs free and is masked on access
+	uint8_t window[LZ_WINDOW_SIZE];
+#endif
+	uint32_t pos;
+	LzState_t state;
+	// literals left, or match length
+	uint32_t count;
+	uint32_t distance;
+} LzDecoder_t;
+
+// how far the image has been committed, kept until the next image starts so
+// a dropped download can carry on with handleNXPDisplayResume
+typedef struct {
+	// host's identity of the image, 0 for none
+	uint32_t imageId;
+	// image committed to flash below this address
+	uint32_t committed;
+	// imageCrc and imageBytes at that point
+	uint32_t crc;
+	uint32_t bytes;
+	// sector the next block goes to, where it starts and imageCrc and
+	// imageBytes up to there
+	uint32_t sectorStart;
+	uint32_t sectorCrc;
+	uint32_t sectorBytes;
+	// that sector was erased, its blocks from committed on are still blank
+	uint32_t sectorErased;
+	// its blocks staged in NXP RAM, the ones committed so far
+	uint32_t staged[RAM_STAGED_WORDS];
+	// CRC-32 of the fields above
+	uint32_t check;
+} NXPJournal_t;
+
+// ISP commands counted by the instrumentation
+typedef enum {
+	ISP_CMD_SYNC,
+	ISP_CMD_J,
+	ISP_CMD_U,
+	ISP_CMD_P,
+	ISP_CMD_E,
+	ISP_CMD_W,
+	ISP_CMD_C,
+	ISP_CMD_A,
+	ISP_CMD_B,
+	ISP_CMD_M,
+	ISP_CMD_R,
+	ISP_CMD_COUNT
+} IspCmd_t;
+
+// ISP return codes, then the outcomes the NXP does not send as a number
+typedef enum {
+	ISP_CMD_SUCCESS = 0,
+	ISP_INVALID_COMMAND = 1,
+	ISP_SRC_ADDR_ERROR = 2,
+	ISP_DST_ADDR_ERROR = 3,
+	ISP_SRC_ADDR_NOT_MAPPED = 4,
+	ISP_DST_ADDR_NOT_MAPPED = 5,
+	ISP_COUNT_ERROR = 6,
+	ISP_INVALID_SECTOR = 7,
+	ISP_SECTOR_NOT_BLANK = 8,
+	ISP_SECTOR_NOT_PREPARED = 9,
+	ISP_COMPARE_ERROR = 10,
+	ISP_BUSY = 11,
+	ISP_PARAM_ERROR = 12,
+	ISP_ADDR_ERROR = 13,
+	ISP_ADDR_NOT_MAPPED = 14,
+	ISP_CMD_LOCKED = 15,
+	ISP_INVALID_CODE = 16,
+	ISP_INVALID_BAUD_RATE = 17,
+	ISP_INVALID_STOP_BIT = 18,
+	ISP_CODE_READ_PROTECTION_ENABLED = 19,
+	// echo or response missing or garbled
+	ISP_NO_RESPONSE = 0x100,
+	// checksum line answered with RESEND
+	ISP_RESEND
+} IspStatus_t;
+
+// what follows the echo
+typedef enum {
+	ISP_REPLY_STATUS, ISP_REPLY_OK
+} IspReply_t;
 
-// current RAM position to write from
+// what keeps the NXP busy between a command and its return code
+typedef enum {
+	ISP_CLASS_ECHO,		// nothing, answered at once
+	ISP_CLASS_ERASE,	// per sector erased
+	ISP_CLASS_COPY,		// per 256 bytes programmed
+	ISP_CLASS_COMPARE,	// per 256 bytes compared
+	ISP_CLASS_COUNT
+} IspClass_t;
+
+// one ISP command: its letter, how many decimal arguments follow, the
+// status other than ISP_CMD_SUCCESS that still completes it and its class
+typedef struct {
+	const char *text;
+	uint8_t textLen;
+	uint8_t argCount;
+	IspStatus_t altStatus;
+	IspClass_t cls;
+} IspCmdDesc_t;
+
+// time one unit of work of a class takes, smoothed with its mean deviation
+// the way TCP keeps its round trip time, in cycles
+typedef struct {
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t count;
+} IspDeadline_t;
+
+// response line taken from the RX ring as its bytes arrive
+typedef struct {
+	uint8_t text[ISP_LINE_MAX];
+	uint32_t len;
+	// text holds a whole line, the next byte starts another one
+	uint8_t complete;
+} IspLine_t;
+
+// a command line on the wire, kept until its response is matched
+typedef struct {
+	IspCmd_t cmd;
+	uint8_t text[NXP_CMD_MAX_LENGTH];
+	uint32_t len;
+	uint32_t start;
+	// units of work of its class, bytes still queued ahead of it
+	uint32_t units;
+	uint32_t queued;
+} IspRequest_t;
+
+// time spent per flashing phase
+typedef enum {
+	PHASE_HANDSHAKE, PHASE_ERASE, PHASE_RAM_WRITE, PHASE_COMPARE, PHASE_COPY,
+	PHASE_READ, PHASE_COUNT
+} IspPhase_t;
+
+typedef struct {
+	uint32_t count;
+	uint32_t errors;
+	uint32_t bytesOut;
+	uint32_t bytesIn;
+	uint32_t minCycles;
+	uint32_t maxCycles;
+	uint64_t totalCycles;
+} IspCmdStats_t;
+
+typedef struct {
+	IspCmdStats_t cmd[ISP_CMD_COUNT];
+	uint64_t phaseCycles[PHASE_COUNT];
+	uint32_t phaseCount[PHASE_COUNT];
+	uint32_t resends;
+	uint32_t handshakeRetries;
+	uint32_t blankBlocks;
+	uint32_t matchedBlocks;
+	uint32_t timeouts;
+	uint32_t recommits;
+	uint32_t syncRetries;
+	uint32_t warmSessions;
+	// deepest stack seen below a handler, in bytes
+	uint32_t stackPeak;
+} NXPStats_t;
+
+// records readable with handleNXPDisplayStats: one per ISP command, one per
+// phase, then the event counters
+#define STATS_RECORD_PHASE (ISP_CMD_COUNT)
+#define STATS_RECORD_EVENTS (ISP_CMD_COUNT + PHASE_COUNT)
+#define STATS_RECORD_FOOTPRINT (STATS_RECORD_EVENTS + 1)
+#define STATS_RECORD_DEADLINE (STATS_RECORD_EVENTS + 2)
+
+// RAM buffer
+static uint32_t byteBufferWords[BUFFER_SIZE / 4];
+static uint8_t * const byteBuffer = (uint8_t *) byteBufferWords;
+
+#if !NXP_LOW_RAM_ENABLE
+// encoded W block, kept for RESEND
+static UUEncodeBlock_t encodedBlock;
+#endif
+
+// 6 bits to uuencode char, 0 goes to 0x60 instead of 0x20
+static const uint8_t uuencodeTable[64] =
+		"`!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_";
+
+// uuencode char to 6 bits, 0x60 and 0x20 both to 0, UUDECODE_BAD for any
+// other char outside 0x20 to 0x5F
+static const uint8_t uudecodeTable[256] = { 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+		0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15,
+		0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21,
+		0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D,
+		0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+		0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x00, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+		0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40 };
+
+// end of the data written to byteBuffer so far
 static uint32_t curBufferSize;
 
-// current flash address to write from
+// flash address of the block in byteBuffer
 static uint32_t offset = 0;
 
+// session state, the NXP echoes every command back until A 0 is issued
+static NXPSession_t session = {
+	.echoEnabled = 1,
+	.unlocked = 0,
+	.synced = 0,
+	.preparedFirst = SECTOR_NONE,
+	.preparedLast = SECTOR_NONE,
+	.ramSector = SECTOR_NONE,
+	.ramStaged = { 0 },
+	.blankStaged = 0
+};
+
+static SectorState_t sectorState[MAX_SECTOR + 1];
+
+// current rate of the local UART and the NXP
+static uint32_t baudRate = NXP_BAUD_DEFAULT;
+
+// B command rates to try after the handshake, fastest first
+static const uint32_t baudRates[] = { 230400 };
+
+static NXPStats_t stats;
+
+static UartTxRing_t uartTx;
+static UartRxRing_t uartRx;
+
+static IspLine_t ispLine;
+
+// from the first ? to Synchronized at the last sync
+static uint32_t syncCycles;
+
+// indexed by IspClass_t. Until a class has been timed a line of a command
+// that does no flash work waits NXP_UART_TIMEOUT_MS, flash work gets five
+// times its datasheet figure.
+static IspDeadline_t deadlines[ISP_CLASS_COUNT] = {
+	{ 0, NXP_UART_TIMEOUT_CYCLES / 4, 0 },
+	{ NXP_MS_CYCLES(NXP_ERASE_SECTOR_MS), NXP_MS_CYCLES(NXP_ERASE_SECTOR_MS),
+			0 },
+	{ NXP_US_CYCLES(NXP_PROGRAM_256_US), NXP_US_CYCLES(NXP_PROGRAM_256_US), 0 },
+	{ NXP_US_CYCLES(NXP_COMPARE_256_US), NXP_US_CYCLES(NXP_COMPARE_256_US), 0 }
+};
+
+// flash work the NXP may still be busy with before the next line, and its
+// class, set while a command waits for its return code
+static uint32_t ispWork;
+static IspClass_t ispClass;
+
+// 1 while NXP_IDLE_HOOK runs inside an NXP request
+static uint8_t ispIdle;
+
+static LzDecoder_t lzDecoder;
+
+// CRC-32 (IEEE 802.3) of the image data taken in since prepare in the order
+// it came, gaps left out, not inverted yet
+static uint32_t imageCrc;
+static uint32_t imageBytes;
+
+// 1 from prepare or resume until terminate succeeds or a command fails in a
+// way that ends the download. Connecting again would forget the staged
+// blocks and sector states the download relies on.
+static uint8_t imageOpen;
+
+static NXPJournal_t journal;
+
+#if NXP_STATS_ENABLE
+// stack pointer at the last handler entry
+static uintptr_t stackBase;
+#endif
+
+
+// CRC-32 4 bits at a time, reflected polynomial EDB88320h
+static const uint32_t crcTable[16] = { 0x00000000, 0x1DB71064, 0x3B6E20C8,
+		0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C, 0xEDB88320,
+		0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278,
+		0xBDBDF21C };
+
+#define ISP_CMD_DESC(text, args, altStatus, cls) \
+	{ text, sizeof(text) - 1, args, altStatus, cls }
+
+// indexed by IspCmd_t, the handshake only uses its text
+static const IspCmdDesc_t ispCmdTable[ISP_CMD_COUNT] = {
+	ISP_CMD_DESC("?", 0, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("J", 0, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("U", 1, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("P", 2, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("E", 2, ISP_CMD_SUCCESS, ISP_CLASS_ERASE),
+	ISP_CMD_DESC("W", 2, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("C", 3, ISP_CMD_SUCCESS, ISP_CLASS_COPY),
+	ISP_CMD_DESC("A", 1, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("B", 2, ISP_CMD_SUCCESS, ISP_CLASS_ECHO),
+	ISP_CMD_DESC("M", 3, ISP_COMPARE_ERROR, ISP_CLASS_COMPARE),
+	ISP_CMD_DESC("R", 2, ISP_CMD_SUCCESS, ISP_CLASS_ECHO)
+};
+
+// "00" to "99", decimal arguments are formatted two digits at a time
+static const char ispDigitPairs[201] =
+		"00010203040506070809101112131415161718192021222324252627282930313233"
+		"34353637383940414243444546474849505152535455565758596061626364656667"
+		"6869707172737475767778798081828384858687888990919293949596979899";
+
+static const SectorGeometry_t sectorGeometry[MAX_SECTOR + 1] = {
+	{ 0x00000, SMALL_SECTOR_SIZE }, { 0x01000, SMALL_SECTOR_SIZE },
+	{ 0x02000, SMALL_SECTOR_SIZE }, { 0x03000, SMALL_SECTOR_SIZE },
+	{ 0x04000, SMALL_SECTOR_SIZE }, { 0x05000, SMALL_SECTOR_SIZE },
+	{ 0x06000, SMALL_SECTOR_SIZE }, { 0x07000, SMALL_SECTOR_SIZE },
+	{ 0x08000, SMALL_SECTOR_SIZE }, { 0x09000, SMALL_SECTOR_SIZE },
+	{ 0x0A000, SMALL_SECTOR_SIZE }, { 0x0B000, SMALL_SECTOR_SIZE },
+	{ 0x0C000, SMALL_SECTOR_SIZE }, { 0x0D000, SMALL_SECTOR_SIZE },
+	{ 0x0E000, SMALL_SECTOR_SIZE }, { 0x0F000, SMALL_SECTOR_SIZE },
+	{ 0x10000, LARGE_SECTOR_SIZE }, { 0x18000, LARGE_SECTOR_SIZE },
+	{ 0x20000, LARGE_SECTOR_SIZE }, { 0x28000, LARGE_SECTOR_SIZE },
+	{ 0x30000, LARGE_SECTOR_SIZE }, { 0x38000, LARGE_SECTOR_SIZE },
+	{ 0x40000, LARGE_SECTOR_SIZE }, { 0x48000, LARGE_SECTOR_SIZE },
+	{ 0x50000, LARGE_SECTOR_SIZE }, { 0x58000, LARGE_SECTOR_SIZE },
+	{ 0x60000, LARGE_SECTOR_SIZE }, { 0x68000, LARGE_SECTOR_SIZE },
+	{ 0x70000, LARGE_SECTOR_SIZE }, { 0x78000, LARGE_SECTOR_SIZE }
+};
+
 //
 // GLOBAL VARIABLE DEFINITIONS
 //
@@ -82,6 +724,11 @@ static uint32_t offset = 0;
 //
 void hex2uuencode(uint8_t *hexStr, uint8_t *uuencodeStr);
 
+void NXPDisplayEncodeBlock(const uint8_t *data, uint32_t size,
+		UUEncodeBlock_t *pBlock);
+
+void NXPDisplaySwapWords(const uint8_t *src, uint32_t *dest, uint32_t words);
+
 HandShakingStatus_t NXPDisplayHandShaking();
 
 uint32_t NXPDisplayVersionCheck();
@@ -90,6 +737,170 @@ uint32_t NXPPrepareSectors();
 
 uint32_t NXPDisplayCMDLength(uint8_t * cmd);
 
+uint32_t NXPIspFormatDecimal(uint32_t value, uint8_t *buf);
+
+void NXPIspFormat(IspRequest_t *pReq, IspCmd_t cmd, const uint32_t *args);
+
+void NXPIspIssue(IspRequest_t *pReq, IspCmd_t cmd, const uint32_t *args);
+
+uint32_t NXPIspReadLine(IspLine_t *pLine, uint32_t *pBytesIn,
+		uint32_t timeout);
+
+uint32_t NXPIspNextLine(uint32_t *pBytesIn);
+
+uint32_t NXPIspWireCycles(uint32_t bytes);
+
+uint32_t NXPIspDeadline(IspClass_t cls, uint32_t units);
+
+uint32_t NXPIspLineTimeout();
+
+void NXPIspDeadlineSample(const IspRequest_t *pReq, uint32_t bytesIn);
+
+void NXPIspDeadlineUpdate(IspClass_t cls, uint32_t sample);
+
+uint32_t NXPIspLineHas(const IspLine_t *pLine, const char *text, uint32_t len);
+
+uint32_t NXPDisplaySyncStep(const char *msg, uint32_t len, uint32_t *pBytesIn);
+
+uint32_t NXPIspLineIs(const IspLine_t *pLine, const void *text, uint32_t len);
+
+IspStatus_t NXPIspLineStatus(const IspLine_t *pLine);
+
+IspStatus_t NXPIspMatch(const uint8_t *sent, uint32_t sentLen,
+		IspReply_t reply, uint32_t *pBytesIn);
+
+IspStatus_t NXPIspAwait(IspRequest_t *pReq);
+
+IspStatus_t NXPIspExecute(IspCmd_t cmd, const uint32_t *args);
+
+void NXPUartInit();
+
+void NXPUartTxStart();
+
+void NXPUartSend(const uint8_t *buf, uint32_t len);
+
+void NXPUartSendWithCR(const uint8_t *buf, uint32_t len);
+
+void NXPUartDrain();
+
+void NXPUartIdle();
+
+uint32_t NXPDisplayBusy(RspFmt_Obj *pRsp);
+
+void NXPUartSetBaudRate(uint32_t baud);
+
+void NXPUartNotification(sciBASE_t *sci, uint32_t flags);
+
+void NXPSessionReset();
+
+void NXPSessionInvalidate();
+
+uint32_t NXPDisplayUnlock();
+
+uint32_t NXPDisplayPrepareRange(uint32_t firstSector, uint32_t lastSector);
+
+uint32_t NXPDisplayEchoOff();
+
+uint32_t NXPDisplayWriteRAM(uint32_t ramAddr, const uint8_t *data,
+		uint32_t size, const NXPEncodedBlock_t *pEncoded);
+
+uint32_t NXPDisplayCommitBlock(uint32_t flashAddr, uint32_t size);
+
+uint32_t NXPDisplayCommitData(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded);
+
+uint32_t NXPDisplayCommitPlanned(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded);
+
+uint32_t NXPDisplayCommitKnown(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded,
+		uint32_t blank);
+
+void NXPDisplayIngestReset();
+
+uint32_t NXPDisplayIngestFlush();
+
+uint32_t NXPDisplayIngestSeek(uint32_t flashAddr);
+
+void NXPLzReset();
+
+uint32_t NXPCrcUpdate(uint32_t crc, const uint8_t *data, uint32_t size);
+
+void NXPDisplayConnect(RspFmt_Obj *pRsp);
+
+void NXPDisplayImageStart(uint32_t imageId);
+
+void NXPJournalUpdate();
+
+uint32_t NXPJournalCheck();
+
+uint32_t NXPDisplayVerifyBlock(uint32_t flashAddr, uint32_t ramAddr,
+		uint32_t size, uint32_t fromAddr);
+
+uint32_t NXPDisplayCompareStaged(uint32_t fromAddr, uint32_t flashAddr,
+		uint32_t size, uint8_t *pMatch);
+
+uint32_t NXPDisplayRecopySector(uint32_t sector, uint32_t endAddr);
+
+uint32_t NXPLzOutput(uint8_t c);
+
+uint32_t NXPLzDecode(uint8_t c);
+
+uint32_t NXPDisplayBlockBlank(const uint8_t *data, uint32_t size);
+
+uint32_t NXPDisplayCopySize(uint32_t bytes);
+
+uint32_t NXPFlashSector(uint32_t flashAddr);
+
+uint32_t NXPFlashSectorStart(uint32_t sector);
+
+uint32_t NXPDisplayCompare(uint32_t flashAddr, uint32_t ramAddr, uint32_t size,
+		uint8_t *pMatch);
+
+uint32_t NXPDisplayCompareBlank(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded,
+		uint8_t *pMatch);
+
+uint32_t NXPDisplayEraseSectors(uint32_t firstSector, uint32_t lastSector);
+
+uint32_t NXPDisplayPlanErase(uint32_t startAddr, uint32_t endAddr);
+
+uint32_t NXPDisplayEraseMask(uint32_t sectorMask);
+
+uint32_t NXPDisplayBaudUpgrade();
+
+void NXPDisplayReset();
+
+HandShakingStatus_t NXPDisplayResync();
+
+uint32_t NXPDisplayWarmConnect();
+
+void NXPDisplayRspPutWord(RspFmt_Obj *pRsp, uint32_t index, uint32_t value);
+
+void NXPStatsCommand(IspCmd_t cmd, uint32_t bytesOut, uint32_t bytesIn,
+		uint32_t start, uint32_t status);
+
+void NXPStatsPhase(IspPhase_t phase, uint32_t start);
+
+void NXPStatsStackBase();
+
+void NXPStatsStack();
+
+uint32_t NXPDisplayEncodeLine(const uint8_t *data, uint32_t num,
+		uint8_t *pLine, uint32_t *pChksum);
+
+uint32_t NXPDisplayWriteLines(const uint8_t *data, uint32_t size,
+		uint32_t *pChksum);
+
+uint32_t NXPDisplayCopyBlock(uint32_t flashAddr, uint32_t ramAddr,
+		uint32_t size);
+
+uint32_t NXPDisplayDecodeLine(const uint8_t *pLine, uint32_t len,
+		uint8_t *pData, uint32_t *pChksum);
+
+uint32_t NXPDisplayReadFlash(uint32_t flashAddr, uint32_t size,
+		uint32_t *pCrc);
+
 //
 // START OF OPERATIONAL CODE
 //
@@ -120,28 +931,390 @@ void hex2uuencode(uint8_t *hexStr, uint8_t *uuencodeStr) {
 	}
 }
 
+/*
+ *  PARAMETERS: data bytes to encode
+ *  			num number of bytes, at most 45
+ *  			pLine encoded line dest, UUENCODE_LINE_MAX + 1 bytes
+ *  			pChksum ISP checksum to add the bytes to
+ *
+ *  DESCRIPTION: uuencode one line. The last group is zero padded, nothing
+ *  			past num is read.
+ *
+ *  RETURNS: line length without the terminating 0
+ *
+ */
+uint32_t NXPDisplayEncodeLine(const uint8_t *data, uint32_t num,
+		uint8_t *pLine, uint32_t *pChksum) {
+	uint8_t *pOut = pLine;
+	uint32_t chksum = *pChksum;
+	uint32_t word;
+	uint32_t j;
+
+	*pOut++ = num + UUENCODE_OFFSET;
+	for (j = 0; j + 3 <= num; j += 3) {
+		word = ((uint32_t) data[0] << 16) | ((uint32_t) data[1] << 8)
+				| data[2];
+		chksum += data[0] + data[1] + data[2];
+		pOut[0] = uuencodeTable[word >> 18];
+		pOut[1] = uuencodeTable[(word >> 12) & 0x3F];
+		pOut[2] = uuencodeTable[(word >> 6) & 0x3F];
+		pOut[3] = uuencodeTable[word & 0x3F];
+		pOut += 4;
+		data += 3;
+	}
+	// 1 or 2 bytes left
+	if (j < num) {
+		word = (uint32_t) data[0] << 16;
+		chksum += data[0];
+		if (j + 1 < num) {
+			word |= (uint32_t) data[1] << 8;
+			chksum += data[1];
+		}
+		pOut[0] = uuencodeTable[word >> 18];
+		pOut[1] = uuencodeTable[(word >> 12) & 0x3F];
+		pOut[2] = uuencodeTable[(word >> 6) & 0x3F];
+		pOut[3] = uuencodeTable[word & 0x3F];
+		pOut += 4;
+	}
+	*pOut = 0;
+	*pChksum = chksum;
+	return pOut - pLine;
+}
+
+/*
+ *  PARAMETERS: data bytes to encode
+ *  			size number of bytes, at most 512
+ *  			pBlock encoded lines and checksum dest
+ *
+ *  DESCRIPTION: uuencode a whole W block into 45 bytes lines and sum the
+ *  			bytes for the ISP checksum in the same pass
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPDisplayEncodeBlock(const uint8_t *data, uint32_t size,
+		UUEncodeBlock_t *pBlock) {
+	uint32_t i;
+	uint32_t num;
+
+	pBlock->chksum = 0;
+	pBlock->lineCount = 0;
+	for (i = 0; i < size; i += num) {
+		num = size - i;
+		if (num > UUENCODE_MAX_BYTES) {
+			num = UUENCODE_MAX_BYTES;
+		}
+		pBlock->lineLen[pBlock->lineCount] = NXPDisplayEncodeLine(data + i,
+				num, pBlock->line[pBlock->lineCount], &pBlock->chksum);
+		pBlock->lineCount++;
+	}
+}
+
+/*
+ *  PARAMETERS: pLine uuencode line as received, without its CR LF
+ *  			len line length
+ *  			pData decoded bytes dest, UUENCODE_MAX_BYTES
+ *  			pChksum ISP checksum to add the bytes to
+ *
+ *  DESCRIPTION: uudecode one line, 4 chars to 3 bytes through uudecodeTable
+ *  			without a test per char. The length char has to agree with the
+ *  			line length and every char has to be a uuencode char.
+ *
+ *  RETURNS: number of bytes decoded, 0 for a garbled line
+ *
+ */
+uint32_t NXPDisplayDecodeLine(const uint8_t *pLine, uint32_t len,
+		uint8_t *pData, uint32_t *pChksum) {
+	const uint8_t *pIn = pLine + 1;
+	uint32_t chksum = *pChksum;
+	uint32_t bad = 0;
+	uint32_t num;
+	uint32_t word;
+	uint32_t j;
+
+	if (len == 0 || len > ISP_LINE_MAX) {
+		return 0;
+	}
+	num = uudecodeTable[pLine[0]];
+	if (num == 0 || num > UUENCODE_MAX_BYTES
+			|| len != 1 + ((num + 2) / 3) * 4) {
+		return 0;
+	}
+	for (j = 0; j < num; j += 3) {
+		bad |= uudecodeTable[pIn[0]] | uudecodeTable[pIn[1]]
+				| uudecodeTable[pIn[2]] | uudecodeTable[pIn[3]];
+		word = ((uint32_t) uudecodeTable[pIn[0]] << 18)
+				| ((uint32_t) uudecodeTable[pIn[1]] << 12)
+				| ((uint32_t) uudecodeTable[pIn[2]] << 6)
+				| uudecodeTable[pIn[3]];
+		// the last group may only hold 1 or 2 bytes, pData has room for 3
+		pData[j] = word >> 16;
+		pData[j + 1] = word >> 8;
+		pData[j + 2] = word;
+		pIn += 4;
+	}
+	if (bad & UUDECODE_BAD) {
+		return 0;
+	}
+	for (j = 0; j < num; j++) {
+		chksum += pData[j];
+	}
+	*pChksum = chksum;
+	return num;
+}
+
+/*
+ *  PARAMETERS: src S-record payload as received
+ *  			dest words in flash order
+ *  			words number of 32 bits words
+ *
+ *  DESCRIPTION: assemble each word from its 4 payload bytes, LSB first
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPDisplaySwapWords(const uint8_t *src, uint32_t *dest, uint32_t words) {
+	uint32_t i;
+	for (i = 0; i < words; i++) {
+		dest[i] = ((uint32_t) src[3] << 24) | ((uint32_t) src[2] << 16)
+				| ((uint32_t) src[1] << 8) | src[0];
+		src += 4;
+	}
+}
+
 /*
  *  PARAMETERS: response
  *
- *  DESCRIPTION: NXP handshaking and prepare sectors
+ *  DESCRIPTION: NXP handshaking and prepare sectors for a new image
  *
  *  RETURNS: void
  *
  */
 void handleNXPDisplayPrepare(RspFmt_Obj *pRsp) {
-	// release NXP from reset
-	canIoSetPort(canREG2, 1, 1);
-	uint32_t error_code = CMD_VALID;
-	int i;
-	for (i = 0; i < BUFFER_SIZE; i++) {
-		byteBuffer[i] = 0xFF;
+	if (NXPDisplayBusy(pRsp)) {
+		return;
+	}
+	NXPStatsStackBase();
+	imageOpen = 1;
+	NXPDisplayImageStart(0);
+	NXPDisplayConnect(pRsp);
+	if (pRsp->status != CMD_VALID) {
+		imageOpen = 0;
+	}
+}
+
+/*
+ *  PARAMETERS: Command, response
+ *
+ *  DESCRIPTION: NXP prepare for an image, carrying on where the journal
+ *  			says an earlier download of the same image stopped. Starts
+ *  			from scratch for any other image or an image id of 0.
+ *  			Responds with the rate and the image address to continue
+ *  			writing from: the first block not committed, or the start of
+ *  			its sector unless that sector had been erased and its blocks
+ *  			are still in NXP RAM. Also the CRC-32 and size of the image
+ *  			data taken in below that address. Only the image id ties the
+ *  			journal to the image, the host compares both with the same
+ *  			prefix of its own image and prepares from scratch when they
+ *  			differ.
+ *
+ *  RETURNS: void
+ *
+ */
+void handleNXPDisplayResume(uint8_t *pCmd, RspFmt_Obj *pRsp) {
+	uint32_t imageId;
+	uint32_t resume = 0;
+	uint32_t sector;
+	uint32_t i;
+	uint8_t match = 0;
+
+	if (NXPDisplayBusy(pRsp)) {
+		return;
+	}
+	NXPStatsStackBase();
+	imageOpen = 1;
+	imageId = (pCmd[RESUME_ID_INDEX] << 24) | (pCmd[RESUME_ID_INDEX + 1] << 16)
+			| (pCmd[RESUME_ID_INDEX + 2] << 8) | pCmd[RESUME_ID_INDEX + 3];
+
+	if (imageId != 0 && imageId == journal.imageId && NXPJournalCheck()) {
+		resume = 1;
+		// nothing half done survives, the rest of the image comes again
+		NXPDisplayIngestReset();
+		NXPLzReset();
+		if (journal.sectorErased) {
+			offset = journal.committed;
+			imageCrc = journal.crc;
+			imageBytes = journal.bytes;
+		} else {
+			offset = journal.sectorStart;
+			imageCrc = journal.sectorCrc;
+			imageBytes = journal.sectorBytes;
+		}
+	} else {
+		NXPDisplayImageStart(imageId);
+	}
+
+	NXPDisplayConnect(pRsp);
+	if (pRsp->status != CMD_VALID) {
+		imageOpen = 0;
+		return;
+	}
+	// a sector is only erased again with all of its blocks staged in NXP RAM,
+	// those committed before the drop still are unless the NXP lost power
+	if (resume && offset != journal.sectorStart
+			&& (offset % NXP_COPY_SIZE) == 0) {
+		sector = NXPFlashSector(offset);
+		session.ramSector = sector;
+		memcpy(session.ramStaged, journal.staged, sizeof(session.ramStaged));
+		// blocks skipped over are not staged, the last one staged goes last
+		match = 1;
+		for (i = RAM_STAGED_BLOCKS; i > 0; i--) {
+			if (session.ramStaged[(i - 1) / 32] & (1UL << ((i - 1) % 32))) {
+				break;
+			}
+		}
+		if (i > 0
+				&& NXPDisplayCompareStaged(journal.sectorStart,
+						journal.sectorStart + (i - 1) * NXP_COPY_SIZE,
+						NXP_COPY_SIZE, &match) != CMD_VALID) {
+			imageOpen = 0;
+			pRsp->status = CMD_POB_REJ;
+			return;
+		}
+		if (match) {
+			sectorState[sector] = SECTOR_ERASED;
+		} else {
+			NXPSessionInvalidate();
+			offset = journal.sectorStart;
+			imageCrc = journal.sectorCrc;
+			imageBytes = journal.sectorBytes;
+		}
+	}
+	NXPDisplayRspPutWord(pRsp, RSP_RESUME_ADDR_INDEX, offset);
+	NXPDisplayRspPutWord(pRsp, RSP_RESUME_CRC_INDEX, imageCrc ^ 0xFFFFFFFF);
+	NXPDisplayRspPutWord(pRsp, RSP_RESUME_BYTES_INDEX, imageBytes);
+}
+
+/*
+ *  PARAMETERS: imageId host's identity of the image, 0 for none
+ *
+ *  DESCRIPTION: start taking in an image from flash address 0
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPDisplayImageStart(uint32_t imageId) {
+	uint32_t sector;
+
+	for (sector = FIRST_SECTOR; sector <= MAX_SECTOR; sector++) {
+		sectorState[sector] = SECTOR_UNCHECKED;
+	}
+	offset = 0;
+	NXPDisplayIngestReset();
+	NXPLzReset();
+	imageCrc = 0xFFFFFFFF;
+	imageBytes = 0;
+	journal.imageId = imageId;
+	NXPJournalUpdate();
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: record offset as committed, called after every commit
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPJournalUpdate() {
+	uint32_t sector = NXPFlashSector(offset);
+	uint32_t sectorStart = NXPFlashSectorStart(sector);
+
+	journal.committed = offset;
+	journal.crc = imageCrc;
+	journal.bytes = imageBytes;
+	// blocks never straddle sectors, a sector is entered at its start or
+	// after a gap, and nothing in it has been taken in before then
+	if (offset == 0 || journal.sectorStart != sectorStart) {
+		journal.sectorStart = sectorStart;
+		journal.sectorCrc = imageCrc;
+		journal.sectorBytes = imageBytes;
+	}
+	journal.sectorErased = sectorState[sector] == SECTOR_ERASED;
+	if (session.ramSector == sector) {
+		memcpy(journal.staged, session.ramStaged, sizeof(journal.staged));
+	} else {
+		memset(journal.staged, 0, sizeof(journal.staged));
+	}
+	journal.check = NXPCrcUpdate(0xFFFFFFFF, (const uint8_t *) &journal,
+			offsetof(NXPJournal_t, check));
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: the journal is intact
+ *
+ *  RETURNS: 1 when it can be trusted
+ *
+ */
+uint32_t NXPJournalCheck() {
+	return journal.check
+			== NXPCrcUpdate(0xFFFFFFFF, (const uint8_t *) &journal,
+					offsetof(NXPJournal_t, check));
+}
+
+/*
+ *  PARAMETERS: response
+ *
+ *  DESCRIPTION: NXP reset, handshaking and prepare sectors, keeping the
+ *  			image position
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPDisplayConnect(RspFmt_Obj *pRsp) {
+	uint32_t start = NXP_CYCLE_COUNT();
+
+	NXPUartInit();
+#if NXP_WARM_SESSION_ENABLE
+	if (NXPDisplayWarmConnect() == CMD_VALID) {
+		NXPDisplayRspPutWord(pRsp, RSP_BAUD_INDEX, baudRate);
+		NXPStatsPhase(PHASE_HANDSHAKE, start);
+		pRsp->status = NXPPrepareSectors();
+		return;
+	}
+#endif
+	// the boot ROM syncs at the default rate
+	if (baudRate != NXP_BAUD_DEFAULT) {
+		baudRate = NXP_BAUD_DEFAULT;
+		NXPUartSetBaudRate(baudRate);
 	}
+	NXPDisplayReset();
+	uint32_t error_code = CMD_VALID;
+	// fresh from reset, the NXP echoes again
+	NXPSessionReset();
 	HandShakingStatus_t handshakingStatus;
 	handshakingStatus = NXPDisplayHandShaking();
 
 	if (handshakingStatus == HANDSHAKING_SUCCESSFUL) {
 		uint32_t version = NXPDisplayVersionCheck();
 		if (version != 0) {
+#if NXP_BAUD_UPGRADE_ENABLE
+			if (NXPDisplayBaudUpgrade() == 0) {
+				pRsp->status = CMD_POB_REJ;
+				return;
+			}
+#endif
+			NXPDisplayRspPutWord(pRsp, RSP_BAUD_INDEX, baudRate);
+#if NXP_STREAMING_ENABLE
+			if (NXPDisplayEchoOff() != CMD_VALID) {
+				pRsp->status = CMD_POB_REJ;
+				return;
+			}
+#endif
+			session.synced = 1;
+			NXPStatsPhase(PHASE_HANDSHAKE, start);
 			error_code = NXPPrepareSectors();
 		} else {
 			error_code = CMD_POB_REJ;
@@ -154,6 +1327,30 @@ void handleNXPDisplayPrepare(RspFmt_Obj *pRsp) {
 	pRsp->status = error_code;
 }
 
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP reuse the session the last job left in ISP mode. The U
+ *  			every session needs anyway shows whether the NXP still answers
+ *  			at baudRate, nothing else is sent.
+ *
+ *  RETURNS: Cmd Status, CMD_POB_REJ when a reset and sync are needed
+ *
+ */
+uint32_t NXPDisplayWarmConnect() {
+	if (!session.synced) {
+		return CMD_POB_REJ;
+	}
+	// blocks staged in NXP RAM belong to the last image
+	NXPSessionInvalidate();
+	if (NXPDisplayUnlock() != CMD_VALID) {
+		session.synced = 0;
+		return CMD_POB_REJ;
+	}
+	stats.warmSessions++;
+	return CMD_VALID;
+}
+
 /*
  *  PARAMETERS: None
  *
@@ -163,573 +1360,2276 @@ void handleNXPDisplayPrepare(RspFmt_Obj *pRsp) {
  *
  */
 HandShakingStatus_t NXPDisplayHandShaking() {
-	uint8_t sendCmd[NXP_CMD_MAX_LENGTH];
-	uint8_t recvBuf[LIN_RECV_BUFFER_SIZE];
-	uint32_t len = 0;
+	uint32_t bytesIn = 0;
+	uint32_t bytesOut = 0;
+	uint32_t start = NXP_CYCLE_COUNT();
+	uint32_t wait = syncCycles;
 	HandShakingStatus_t handShakingStatus = HANDSHAKING_START;
+
+	if (wait < NXP_MS_CYCLES(HANDSHAKE_RETRY_MIN_MS)) {
+		wait = NXP_MS_CYCLES(HANDSHAKE_RETRY_MIN_MS);
+	}
 	switch (handShakingStatus) {
 	case HANDSHAKING_START:
-		snprintf((char *) sendCmd, sizeof(sendCmd), HANDSHANKING_START_MSG);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSend(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, strlen(RESPONSE_SYN));
-		if (strncmp((char *) recvBuf, RESPONSE_SYN, strlen(RESPONSE_SYN))
-				!= 0) {
-			break;
+		// ? until the boot ROM has found the rate, other lines are noise
+		while (NXP_CYCLE_COUNT() - start < NXP_MS_CYCLES(HANDSHAKE_BUDGET_MS)) {
+			NXPUartSend((const uint8_t *) HANDSHANKING_START_MSG,
+					sizeof(HANDSHANKING_START_MSG) - 1);
+			bytesOut += sizeof(HANDSHANKING_START_MSG) - 1;
+			// noise keeps lines coming, it must not outlast the budget
+			while (NXP_CYCLE_COUNT() - start
+					< NXP_MS_CYCLES(HANDSHAKE_BUDGET_MS)
+					&& NXPIspReadLine(&ispLine, &bytesIn, wait)) {
+				if (NXPIspLineHas(&ispLine, RESPONSE_SYN,
+						sizeof(RESPONSE_SYN) - 1)) {
+					handShakingStatus = HANDSHAKING_SYN;
+					break;
+				}
+			}
+			if (handShakingStatus == HANDSHAKING_SYN) {
+				break;
+			}
+			stats.syncRetries++;
+			wait *= 2;
+			if (wait > NXP_MS_CYCLES(HANDSHAKE_RETRY_MAX_MS)) {
+				wait = NXP_MS_CYCLES(HANDSHAKE_RETRY_MAX_MS);
+			}
 		}
-		handShakingStatus = HANDSHAKING_SYN;
-	case HANDSHAKING_SYN:
-		snprintf((char *) sendCmd, sizeof(sendCmd), HANDSHAKING_SYN_MSG);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, strlen(RESPONSE_SYN) + strlen(RESPONSE_OK) + 1);
-		if (strncmp((char *) recvBuf, RESPONSE_SYN, strlen(RESPONSE_SYN))
-				!= 0) {
+		if (handShakingStatus != HANDSHAKING_SYN) {
 			break;
 		}
-		if (strncmp((char *) recvBuf + strlen(RESPONSE_SYN) + 1, RESPONSE_OK,
-				strlen(RESPONSE_OK)) != 0) {
+		syncCycles = NXP_CYCLE_COUNT() - start;
+		/* fall through */
+	case HANDSHAKING_SYN:
+		bytesOut += sizeof(HANDSHAKING_SYN_MSG);
+		if (!NXPDisplaySyncStep(HANDSHAKING_SYN_MSG,
+				sizeof(HANDSHAKING_SYN_MSG) - 1, &bytesIn)) {
 			break;
 		}
 		handShakingStatus = HANDSHAKING_ACK;
+		/* fall through */
 	case HANDSHAKING_ACK:
-		snprintf((char *) sendCmd, sizeof(sendCmd), HANDSHAKING_ACK_MSG);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, strlen(RESPONSE_ZERO) + strlen(RESPONSE_OK) + 1);
-		if (strncmp((char *) recvBuf, RESPONSE_ZERO, strlen(RESPONSE_ZERO))
-				!= 0) {
-			break;
-		}
-		if (strncmp((char *) recvBuf + strlen(RESPONSE_ZERO) + 1, RESPONSE_OK,
-				strlen(RESPONSE_OK)) != 0) {
+		bytesOut += sizeof(HANDSHAKING_ACK_MSG);
+		if (!NXPDisplaySyncStep(HANDSHAKING_ACK_MSG,
+				sizeof(HANDSHAKING_ACK_MSG) - 1, &bytesIn)) {
 			break;
 		}
 		handShakingStatus = HANDSHAKING_SUCCESSFUL;
 	default:
 		break;
 	}
+	NXPStatsCommand(ISP_CMD_SYNC, bytesOut, bytesIn, start,
+			handShakingStatus == HANDSHAKING_SUCCESSFUL ?
+					CMD_VALID : CMD_POB_REJ);
 	return handShakingStatus;
 }
 
 /*
- *  PARAMETERS: Command
+ *  PARAMETERS: msg line to send, len
+ *  			pBytesIn bytes received are added here
  *
- *  DESCRIPTION: NXP Command length
+ *  DESCRIPTION: NXP send one handshake line and wait for OK, skipping its
+ *  			echo
  *
- *  RETURNS: length
+ *  RETURNS: 1 when the NXP answered OK
  *
  */
-uint32_t NXPDisplayCMDLength(uint8_t * cmd) {
-	return strlen((char *) cmd);
+uint32_t NXPDisplaySyncStep(const char *msg, uint32_t len, uint32_t *pBytesIn) {
+	NXPUartSendWithCR((const uint8_t *) msg, len);
+	while (NXPIspNextLine(pBytesIn)) {
+		if (NXPIspLineHas(&ispLine, msg, len)) {
+			continue;
+		}
+		return NXPIspLineHas(&ispLine, RESPONSE_OK, sizeof(RESPONSE_OK) - 1);
+	}
+	return 0;
 }
 
 /*
  *  PARAMETERS: None
  *
- *  DESCRIPTION: NXP FW Version Check
+ *  DESCRIPTION: NXP B command, move the link to the fastest rate in baudRates
+ *  			that answers a J. A rate that fails leaves the NXP unreachable,
+ *  			so it is reset and synced again at the default rate before the
+ *  			next one is tried. Must run while echo is on.
  *
- *  RETURNS: Version, 0 for unsuccessful
+ *  RETURNS: negotiated rate, 0 when the NXP could not be synced again
  *
  */
-uint32_t NXPDisplayVersionCheck() {
-	uint32_t version = 0;
-	uint8_t sendCmd[NXP_CMD_MAX_LENGTH], recvBuf[LIN_RECV_BUFFER_SIZE];
-	uint32_t len = 0;
-	snprintf((char *) sendCmd, sizeof(sendCmd), VERSION_CHECK_CMD);
-	len = NXPDisplayCMDLength(sendCmd);
-	UARTSendWithCR(sendCmd, len);
-	memset(recvBuf, 0, sizeof(recvBuf));
-	UARTRecv(recvBuf,
-			strlen(
-					VERSION_CHECK_CMD) + 1 + strlen(RESPONSE_ZERO) + 2 + VERSION_LEN);
-	if (strncmp((char *) recvBuf, VERSION_CHECK_CMD, strlen(VERSION_CHECK_CMD))
-			!= 0) {
-		return 0;
-	}
-	if (strncmp((char *) recvBuf + strlen(VERSION_CHECK_CMD) + 1, RESPONSE_ZERO,
-			strlen(RESPONSE_ZERO)) != 0) {
-		return 0;
-	}
-	int i;
-	for (i = strlen(VERSION_CHECK_CMD) + 1 + strlen(RESPONSE_ZERO) + 2;
-			i < strlen((char *) recvBuf); i++) {
-		if (recvBuf[i] >= '0' && recvBuf[i] <= '9') {
-			version = version * 10 + recvBuf[i] - '0';
+uint32_t NXPDisplayBaudUpgrade() {
+	uint32_t args[2];
+	uint32_t i;
+
+	for (i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++) {
+		if (baudRates[i] <= baudRate) {
+			continue;
+		}
+		// the answer still comes at the old rate
+		args[0] = baudRates[i];
+		args[1] = NXP_STOP_BITS;
+		if (NXPIspExecute(ISP_CMD_B, args) != ISP_CMD_SUCCESS) {
+			continue;
+		}
+		NXPUartSetBaudRate(baudRates[i]);
+		if (NXPDisplayVersionCheck() != 0) {
+			baudRate = baudRates[i];
+			return baudRate;
+		}
+
+		// fall back
+		NXPUartSetBaudRate(NXP_BAUD_DEFAULT);
+		baudRate = NXP_BAUD_DEFAULT;
+		if (NXPDisplayResync() != HANDSHAKING_SUCCESSFUL) {
+			return 0;
 		}
 	}
-	return version;
+	return baudRate;
 }
 
 /*
  *  PARAMETERS: None
  *
- *  DESCRIPTION: NXP Sector prepare and erase
+ *  DESCRIPTION: NXP reset into the boot ROM, RESET is held low for
+ *  			NXP_RESET_HOLD_MS
  *
- *  RETURNS: Cmd Status
+ *  RETURNS: void
+ *
+ */
+void NXPDisplayReset() {
+	uint32_t start;
+
+	canIoSetPort(canREG2, 1, 0);
+	start = NXP_CYCLE_COUNT();
+	while (NXP_CYCLE_COUNT() - start < NXP_MS_CYCLES(NXP_RESET_HOLD_MS)) {
+		NXPUartIdle();
+	}
+	canIoSetPort(canREG2, 1, 1);
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP reset and handshaking again
+ *
+ *  RETURNS: HandShakingStatus HANDSHAKING_SUCCESSFUL or not
+ *
+ */
+HandShakingStatus_t NXPDisplayResync() {
+	stats.handshakeRetries++;
+	NXPDisplayReset();
+	NXPSessionReset();
+	return NXPDisplayHandShaking();
+}
+
+/*
+ *  PARAMETERS: pRsp response
+ *  			index into response data
+ *  			value
+ *
+ *  DESCRIPTION: put a word into the response data, MSB first like the
+ *  			CAN command data
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPDisplayRspPutWord(RspFmt_Obj *pRsp, uint32_t index, uint32_t value) {
+	pRsp->data[index] = (value >> 24) & 0xFF;
+	pRsp->data[index + 1] = (value >> 16) & 0xFF;
+	pRsp->data[index + 2] = (value >> 8) & 0xFF;
+	pRsp->data[index + 3] = value & 0xFF;
+	if (pRsp->numBytes < index + 4) {
+		pRsp->numBytes = index + 4;
+	}
+}
+
+/*
+ *  PARAMETERS: Command
+ *
+ *  DESCRIPTION: NXP Command length
+ *
+ *  RETURNS: length
+ *
+ */
+uint32_t NXPDisplayCMDLength(uint8_t * cmd) {
+	return strlen((char *) cmd);
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP FW Version Check
+ *
+ *  RETURNS: Version, 0 for unsuccessful
+ *
+ */
+uint32_t NXPDisplayVersionCheck() {
+	uint32_t version = 0;
+	uint32_t i;
+
+	if (NXPIspExecute(ISP_CMD_J, NULL) != ISP_CMD_SUCCESS) {
+		return 0;
+	}
+	// the part id line
+	if (!NXPIspNextLine(&stats.cmd[ISP_CMD_J].bytesIn)) {
+		return 0;
+	}
+	for (i = 0; i < ispLine.len && i < ISP_LINE_MAX; i++) {
+		if (ispLine.text[i] >= '0' && ispLine.text[i] <= '9') {
+			version = version * 10 + ispLine.text[i] - '0';
+		}
+	}
+	return version;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP unlock, sectors are erased later as the image reaches them
+ *
+ *  RETURNS: Cmd Status
  *
  */
 uint32_t NXPPrepareSectors() {
-	uint8_t sendCmd[NXP_CMD_MAX_LENGTH], recvBuf[LIN_RECV_BUFFER_SIZE];
-	uint32_t len = 0;
+	int i;
+
+	// U command unlock the flash write/eraze
+	if (NXPDisplayUnlock() != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
+
+	// sectors are erased (or compared) when their blocks are committed
+	for (i = FIRST_SECTOR; i <= MAX_SECTOR; i++) {
+		sectorState[i] = SECTOR_UNCHECKED;
+	}
+
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: value
+ *  			buf dest, room for ISP_DECIMAL_MAX digits
+ *
+ *  DESCRIPTION: decimal digits of value without a terminator, two at a time
+ *  			from ispDigitPairs
+ *
+ *  RETURNS: number of digits
+ *
+ */
+uint32_t NXPIspFormatDecimal(uint32_t value, uint8_t *buf) {
+	uint8_t digits[ISP_DECIMAL_MAX];
+	uint32_t pos = ISP_DECIMAL_MAX;
+	uint32_t pair;
+
+	while (value >= 100) {
+		pair = (value % 100) * 2;
+		value /= 100;
+		digits[--pos] = ispDigitPairs[pair + 1];
+		digits[--pos] = ispDigitPairs[pair];
+	}
+	if (value >= 10) {
+		digits[--pos] = ispDigitPairs[value * 2 + 1];
+		digits[--pos] = ispDigitPairs[value * 2];
+	} else {
+		digits[--pos] = '0' + value;
+	}
+	memcpy(buf, digits + pos, ISP_DECIMAL_MAX - pos);
+	return ISP_DECIMAL_MAX - pos;
+}
+
+/*
+ *  PARAMETERS: pReq request dest
+ *  			cmd ISP command
+ *  			args its arguments, as many as ispCmdTable gives
+ *
+ *  DESCRIPTION: build a command line from its ispCmdTable entry
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPIspFormat(IspRequest_t *pReq, IspCmd_t cmd, const uint32_t *args) {
+	const IspCmdDesc_t *pDesc = &ispCmdTable[cmd];
+	uint32_t len = pDesc->textLen;
+	uint32_t i;
+
+	memcpy(pReq->text, pDesc->text, len);
+	for (i = 0; i < pDesc->argCount; i++) {
+		pReq->text[len++] = ' ';
+		len += NXPIspFormatDecimal(args[i], pReq->text + len);
+	}
+	pReq->cmd = cmd;
+	pReq->len = len;
+}
+
+/*
+ *  PARAMETERS: pReq request dest
+ *  			cmd ISP command
+ *  			args its arguments
+ *
+ *  DESCRIPTION: NXP queue a command and return while it is sent, finish it
+ *  			with NXPIspAwait
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPIspIssue(IspRequest_t *pReq, IspCmd_t cmd, const uint32_t *args) {
+	IspClass_t cls = ispCmdTable[cmd].cls;
+
+	pReq->start = NXP_CYCLE_COUNT();
+	NXPIspFormat(pReq, cmd, args);
+	switch (cls) {
+	case ISP_CLASS_ERASE:
+		pReq->units = args[1] - args[0] + 1;
+		break;
+	case ISP_CLASS_COPY:
+	case ISP_CLASS_COMPARE:
+		pReq->units = (args[2] + 255) / 256;
+		break;
+	default:
+		pReq->units = 1;
+		break;
+	}
+	pReq->queued = uartTx.head - uartTx.tail;
+	ispClass = cls;
+	ispWork = cls == ISP_CLASS_ECHO ? 0 : NXPIspDeadline(cls, pReq->units);
+	NXPUartSendWithCR(pReq->text, pReq->len);
+}
+
+/*
+ *  PARAMETERS: pLine line being assembled, kept across calls
+ *  			pBytesIn bytes taken are added here
+ *  			timeout cycles to wait for each byte
+ *
+ *  DESCRIPTION: take bytes from the RX ring as they arrive until a line is
+ *  			complete, sleeping while the ring is empty. CR, LF or CR LF end
+ *  			a line, empty lines are skipped. A line cut off by a timeout is
+ *  			carried on by the next call.
+ *
+ *  RETURNS: 1 when pLine holds a line, 0 when timeout passed without a byte
+ *
+ */
+uint32_t NXPIspReadLine(IspLine_t *pLine, uint32_t *pBytesIn,
+		uint32_t timeout) {
+	uint32_t start = NXP_CYCLE_COUNT();
+	uint8_t c;
+
+	NXPStatsStack();
+	if (pLine->complete) {
+		pLine->len = 0;
+		pLine->complete = 0;
+	}
+	for (;;) {
+		if (uartRx.head == uartRx.tail) {
+			if (NXP_CYCLE_COUNT() - start >= timeout) {
+				return 0;
+			}
+			NXPUartIdle();
+			continue;
+		}
+		c = uartRx.data[uartRx.tail & (UART_RX_RING_SIZE - 1)];
+		uartRx.tail++;
+		(*pBytesIn)++;
+		start = NXP_CYCLE_COUNT();
+		if (c == '\r' || c == '\n') {
+			if (pLine->len != 0) {
+				pLine->complete = 1;
+				return 1;
+			}
+			continue;
+		}
+		if (pLine->len < ISP_LINE_MAX) {
+			pLine->text[pLine->len] = c;
+		}
+		pLine->len++;
+	}
+}
+
+/*
+ *  PARAMETERS: pBytesIn bytes taken are added here
+ *
+ *  DESCRIPTION: the next line of a response into ispLine. A timeout doubles
+ *  			the deviation of the class waited for, the deadline it missed
+ *  			may just have been too short.
+ *
+ *  RETURNS: 1 when ispLine holds it, 0 on a response timeout
+ *
+ */
+uint32_t NXPIspNextLine(uint32_t *pBytesIn) {
+	if (NXPIspReadLine(&ispLine, pBytesIn, NXPIspLineTimeout())) {
+		return 1;
+	}
+	stats.timeouts++;
+#if NXP_ADAPTIVE_DEADLINE_ENABLE
+	if (deadlines[ispClass].rttvar < NXP_UART_TIMEOUT_CYCLES) {
+		deadlines[ispClass].rttvar *= 2;
+	}
+#endif
+	return 0;
+}
+
+/*
+ *  PARAMETERS: bytes
+ *
+ *  DESCRIPTION: time bytes take on the wire at baudRate
+ *
+ *  RETURNS: cycles
+ *
+ */
+uint32_t NXPIspWireCycles(uint32_t bytes) {
+	return (uint32_t) ((uint64_t) bytes * (9 + NXP_STOP_BITS) * NXP_CPU_HZ
+			/ baudRate);
+}
+
+/*
+ *  PARAMETERS: cls command class
+ *  			units of work
+ *
+ *  DESCRIPTION: how long the NXP may take over units of work of a class,
+ *  			the smoothed time plus 4 deviations for each
+ *
+ *  RETURNS: cycles
+ *
+ */
+uint32_t NXPIspDeadline(IspClass_t cls, uint32_t units) {
+	const IspDeadline_t *pDeadline = &deadlines[cls];
+	uint64_t cycles = (uint64_t) units
+			* (pDeadline->srtt + 4ULL * pDeadline->rttvar);
+
+	return cycles > 0x7FFFFFFF ? 0x7FFFFFFF : (uint32_t) cycles;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: how long to wait for a byte of the next response line: the
+ *  			NXP's turnaround, the flash work of the command waiting for
+ *  			its return code, and the wire time of what is still queued to
+ *  			go out plus a whole line coming back. Fixed deadlines wait
+ *  			NXP_UART_TIMEOUT_MS plus the flash work at its seed.
+ *
+ *  RETURNS: cycles
+ *
+ */
+uint32_t NXPIspLineTimeout() {
+#if NXP_ADAPTIVE_DEADLINE_ENABLE
+	uint64_t cycles = NXPIspDeadline(ISP_CLASS_ECHO, 1);
+
+	if (cycles > NXP_UART_TIMEOUT_CYCLES) {
+		cycles = NXP_UART_TIMEOUT_CYCLES;
+	}
+	cycles += ispWork
+			+ NXPIspWireCycles(uartTx.head - uartTx.tail + ISP_LINE_MAX + 2);
+	if (cycles < NXP_MS_CYCLES(NXP_DEADLINE_MIN_MS)) {
+		cycles = NXP_MS_CYCLES(NXP_DEADLINE_MIN_MS);
+	}
+	return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) cycles;
+#else
+	return NXP_UART_TIMEOUT_CYCLES + ispWork;
+#endif
+}
+
+/*
+ *  PARAMETERS: pReq command that completed
+ *  			bytesIn bytes of its response
+ *
+ *  DESCRIPTION: time one unit of work of its class from a command that
+ *  			completed. The wire time of both lines is taken off, and for
+ *  			flash work the NXP's turnaround too.
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPIspDeadlineSample(const IspRequest_t *pReq, uint32_t bytesIn) {
+	IspClass_t cls = ispCmdTable[pReq->cmd].cls;
+	uint32_t sample = NXP_CYCLE_COUNT() - pReq->start;
+	uint32_t wire = NXPIspWireCycles(pReq->queued + pReq->len + 1 + bytesIn);
+
+	sample = sample > wire ? sample - wire : 0;
+	if (cls != ISP_CLASS_ECHO) {
+		sample = sample > deadlines[ISP_CLASS_ECHO].srtt ?
+				sample - deadlines[ISP_CLASS_ECHO].srtt : 0;
+		sample /= pReq->units;
+	}
+	NXPIspDeadlineUpdate(cls, sample);
+}
+
+/*
+ *  PARAMETERS: cls command class
+ *  			sample cycles one unit took
+ *
+ *  DESCRIPTION: smooth the time per unit by 1/8 and its deviation by 1/4,
+ *  			the first sample replaces the datasheet seed. The deviation
+ *  			never drops below a quarter of the time, a deadline is at
+ *  			least twice what the work took so far.
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPIspDeadlineUpdate(IspClass_t cls, uint32_t sample) {
+	IspDeadline_t *pDeadline = &deadlines[cls];
+	uint32_t diff;
+
+	if (pDeadline->count == 0) {
+		pDeadline->srtt = sample;
+		pDeadline->rttvar = sample / 2;
+	} else {
+		diff = sample > pDeadline->srtt ?
+				sample - pDeadline->srtt : pDeadline->srtt - sample;
+		pDeadline->rttvar = pDeadline->rttvar - pDeadline->rttvar / 4
+				+ diff / 4;
+		pDeadline->srtt = pDeadline->srtt - pDeadline->srtt / 8 + sample / 8;
+	}
+	if (pDeadline->rttvar < pDeadline->srtt / 4) {
+		pDeadline->rttvar = pDeadline->srtt / 4;
+	}
+	pDeadline->count++;
+}
+
+/*
+ *  PARAMETERS: pLine complete line
+ *  			text, len
+ *
+ *  DESCRIPTION: line compare
+ *
+ *  RETURNS: 1 when the line is exactly text
+ *
+ */
+uint32_t NXPIspLineIs(const IspLine_t *pLine, const void *text, uint32_t len) {
+	return pLine->len == len && memcmp(pLine->text, text, len) == 0;
+}
+
+/*
+ *  PARAMETERS: pLine complete line
+ *  			text, len
+ *
+ *  DESCRIPTION: loose line compare for the handshake, blanks around the
+ *  			text and ? echoed by the autobaud in front of it are ignored
+ *
+ *  RETURNS: 1 when the line holds text
+ *
+ */
+uint32_t NXPIspLineHas(const IspLine_t *pLine, const char *text, uint32_t len) {
+	uint32_t first = 0;
+	uint32_t last = pLine->len;
+
+	if (last > ISP_LINE_MAX) {
+		return 0;
+	}
+	while (first < last && (pLine->text[first] == '?'
+			|| pLine->text[first] == ' ' || pLine->text[first] == '\t')) {
+		first++;
+	}
+	while (last > first && (pLine->text[last - 1] == ' '
+			|| pLine->text[last - 1] == '\t')) {
+		last--;
+	}
+	return last - first == len && memcmp(pLine->text + first, text, len) == 0;
+}
+
+/*
+ *  PARAMETERS: pLine complete line
+ *
+ *  DESCRIPTION: ISP return code on a line of its own
+ *
+ *  RETURNS: IspStatus_t, ISP_NO_RESPONSE when the line is not a number
+ *
+ */
+IspStatus_t NXPIspLineStatus(const IspLine_t *pLine) {
+	uint32_t code = 0;
+	uint32_t i;
+
+	// return codes are one or two digits
+	if (pLine->len > 2) {
+		return ISP_NO_RESPONSE;
+	}
+	for (i = 0; i < pLine->len; i++) {
+		if (pLine->text[i] < '0' || pLine->text[i] > '9') {
+			return ISP_NO_RESPONSE;
+		}
+		code = code * 10 + pLine->text[i] - '0';
+	}
+	return (IspStatus_t) code;
+}
+
+/*
+ *  PARAMETERS: sent line sent
+ *  			sentLen its length
+ *  			reply what the NXP answers it with, a return code or OK/RESEND
+ *  			pBytesIn bytes received are added here
+ *
+ *  DESCRIPTION: NXP take response lines until the answer to a line sent. Its
+ *  			echo is skipped whether or not echo is on, the first other
+ *  			line completes the response.
+ *
+ *  RETURNS: IspStatus_t
+ *
+ */
+IspStatus_t NXPIspMatch(const uint8_t *sent, uint32_t sentLen,
+		IspReply_t reply, uint32_t *pBytesIn) {
+	uint32_t echoed = 0;
+
+	while (NXPIspNextLine(pBytesIn)) {
+		if (!echoed && NXPIspLineIs(&ispLine, sent, sentLen)) {
+			echoed = 1;
+			continue;
+		}
+		if (reply == ISP_REPLY_STATUS) {
+			return NXPIspLineStatus(&ispLine);
+		}
+		if (NXPIspLineIs(&ispLine, RESPONSE_OK, sizeof(RESPONSE_OK) - 1)) {
+			return ISP_CMD_SUCCESS;
+		}
+		if (NXPIspLineIs(&ispLine, RESPONSE_RESEND,
+				sizeof(RESPONSE_RESEND) - 1)) {
+			return ISP_RESEND;
+		}
+		return ISP_NO_RESPONSE;
+	}
+	return ISP_NO_RESPONSE;
+}
+
+/*
+ *  PARAMETERS: pReq issued command
+ *
+ *  DESCRIPTION: NXP wait for the return code of an issued command, count it
+ *  			and forget the session state when it failed
+ *
+ *  RETURNS: IspStatus_t
+ *
+ */
+IspStatus_t NXPIspAwait(IspRequest_t *pReq) {
+	uint32_t bytesIn = 0;
+	IspStatus_t status;
+	uint32_t valid;
+
+	status = NXPIspMatch(pReq->text, pReq->len, ISP_REPLY_STATUS, &bytesIn);
+	valid = status == ISP_CMD_SUCCESS
+			|| status == ispCmdTable[pReq->cmd].altStatus;
+	NXPStatsCommand(pReq->cmd, pReq->len + 1, bytesIn, pReq->start,
+			valid ? CMD_VALID : CMD_POB_REJ);
+	if (!valid) {
+		NXPSessionInvalidate();
+	} else if (NXP_ADAPTIVE_DEADLINE_ENABLE) {
+		NXPIspDeadlineSample(pReq, bytesIn);
+	}
+	// the lines that may follow come straight away
+	ispWork = 0;
+	ispClass = ISP_CLASS_ECHO;
+	return status;
+}
+
+/*
+ *  PARAMETERS: cmd ISP command
+ *  			args its arguments
+ *
+ *  DESCRIPTION: NXP send a command and wait for its return code
+ *
+ *  RETURNS: IspStatus_t
+ *
+ */
+IspStatus_t NXPIspExecute(IspCmd_t cmd, const uint32_t *args) {
+	IspRequest_t req;
+
+	NXPIspIssue(&req, cmd, args);
+	return NXPIspAwait(&req);
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: forget the session state, the NXP is fresh from reset
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPSessionReset() {
+	session.echoEnabled = 1;
+	session.synced = 0;
+	NXPSessionInvalidate();
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: forget what the NXP is known to hold after an error response,
+ *  			the echo mode is kept since no error changes it
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPSessionInvalidate() {
+	session.unlocked = 0;
+	session.preparedFirst = SECTOR_NONE;
+	session.preparedLast = SECTOR_NONE;
+	session.ramSector = SECTOR_NONE;
+	memset(session.ramStaged, 0, sizeof(session.ramStaged));
+	session.blankStaged = 0;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP U command, unless already unlocked in this session
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayUnlock() {
+	static const uint32_t args[] = { ISP_UNLOCK_CODE };
+
+	if (session.unlocked) {
+		return CMD_VALID;
+	}
+	if (NXPIspExecute(ISP_CMD_U, args) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
+	session.unlocked = 1;
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: firstSector, lastSector
+ *
+ *  DESCRIPTION: NXP P command, unless the sectors are still prepared. A
+ *  			successful C or E protects the sectors again.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayPrepareRange(uint32_t firstSector, uint32_t lastSector) {
+	const uint32_t args[] = { firstSector, lastSector };
+
+	if (session.preparedFirst <= firstSector
+			&& lastSector <= session.preparedLast) {
+		return CMD_VALID;
+	}
+	if (NXPIspExecute(ISP_CMD_P, args) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
+	session.preparedFirst = firstSector;
+	session.preparedLast = lastSector;
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP A 0 command, turn the echo off for the rest of the session
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayEchoOff() {
+	static const uint32_t args[] = { 0 };
+
+	if (!session.echoEnabled) {
+		return CMD_VALID;
+	}
+	// A 0 itself is still echoed
+	if (NXPIspExecute(ISP_CMD_A, args) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
+	session.echoEnabled = 0;
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: ramAddr NXP RAM address to write to
+ *  			data bytes to write
+ *  			size number of bytes, at most 512
+ *  			pEncoded the same block encoded ahead of time, or NULL
+ *
+ *  DESCRIPTION: NXP W command, uuencode and send one RAM block.
+ *  			With echo off all lines are queued back to back and only the
+ *  			checksum response is checked, RESEND sends the block again.
+ *  			A pre-encoded block goes out as one send with echo off, with
+ *  			echo on every line is checked so it is encoded here anyway.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayWriteRAM(uint32_t ramAddr, const uint8_t *data,
+		uint32_t size, const NXPEncodedBlock_t *pEncoded) {
+	const uint32_t args[] = { ramAddr, size };
+	IspRequest_t req;
+	uint8_t chksum[ISP_DECIMAL_MAX];
+	IspStatus_t status;
+	uint32_t chksumValue;
+	uint32_t len;
+	int retry;
+
+	// encode while the W command is on the wire
+	NXPIspIssue(&req, ISP_CMD_W, args);
+	if (session.echoEnabled) {
+		pEncoded = NULL;
+	}
+#if !NXP_LOW_RAM_ENABLE
+	if (pEncoded == NULL) {
+		NXPDisplayEncodeBlock(data, size, &encodedBlock);
+	}
+#endif
+	if (NXPIspAwait(&req) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
+
+	for (retry = 0; retry <= ISP_RESEND_MAX; retry++) {
+		if (pEncoded != NULL) {
+			NXPUartSend(pEncoded->text, pEncoded->len);
+			stats.cmd[ISP_CMD_W].bytesOut += pEncoded->len;
+			chksumValue = pEncoded->chksum;
+		} else if (NXPDisplayWriteLines(data, size, &chksumValue)
+				!= CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+
+		// check-sum
+		len = NXPIspFormatDecimal(chksumValue, chksum);
+		NXPUartSendWithCR(chksum, len);
+		stats.cmd[ISP_CMD_W].bytesOut += len + 1;
+		status = NXPIspMatch(chksum, len, ISP_REPLY_OK,
+				&stats.cmd[ISP_CMD_W].bytesIn);
+		if (status == ISP_CMD_SUCCESS) {
+			NXPStatsPhase(PHASE_RAM_WRITE, req.start);
+			return CMD_VALID;
+		}
+		if (status != ISP_RESEND) {
+			NXPSessionInvalidate();
+			return CMD_POB_REJ;
+		}
+		stats.resends++;
+	}
+	NXPSessionInvalidate();
+	return CMD_POB_REJ;
+}
+
+/*
+ *  PARAMETERS: data bytes of the W block
+ *  			size number of bytes, at most 512
+ *  			pChksum ISP checksum of the block dest
+ *
+ *  DESCRIPTION: send the uuencode lines of a W block, checking each echo
+ *  			while echo is on. The low RAM build encodes each line from
+ *  			data right before it goes out and sums the checksum on the way,
+ *  			the other one sends the lines encodedBlock holds.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayWriteLines(const uint8_t *data, uint32_t size,
+		uint32_t *pChksum) {
+#if NXP_LOW_RAM_ENABLE
+	uint8_t line[UUENCODE_LINE_MAX + 1];
+	uint32_t num;
+#endif
+	const uint8_t *pLine;
+	uint32_t len;
+	uint32_t i;
+
+	// uuencoded lines, max 45 bytes each
+#if NXP_LOW_RAM_ENABLE
+	*pChksum = 0;
+	for (i = 0; i < size; i += num) {
+		num = size - i;
+		if (num > UUENCODE_MAX_BYTES) {
+			num = UUENCODE_MAX_BYTES;
+		}
+		len = NXPDisplayEncodeLine(data + i, num, line, pChksum);
+		pLine = line;
+#else
+	// encoded from data ahead of time
+	(void) data;
+	(void) size;
+	*pChksum = encodedBlock.chksum;
+	for (i = 0; i < encodedBlock.lineCount; i++) {
+		len = encodedBlock.lineLen[i];
+		pLine = encodedBlock.line[i];
+#endif
+		NXPUartSendWithCR(pLine, len);
+		stats.cmd[ISP_CMD_W].bytesOut += len + 1;
+		if (session.echoEnabled) {
+			if (!NXPIspNextLine(&stats.cmd[ISP_CMD_W].bytesIn)
+					|| !NXPIspLineIs(&ispLine, pLine, len)) {
+				NXPSessionInvalidate();
+				return CMD_POB_REJ;
+			}
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address
+ *
+ *  DESCRIPTION: LPC1788 sector number of a flash address
+ *
+ *  RETURNS: sector
+ *
+ */
+uint32_t NXPFlashSector(uint32_t flashAddr) {
+	uint32_t sector = MAX_SECTOR;
+	while (sector > FIRST_SECTOR && sectorGeometry[sector].start > flashAddr) {
+		sector--;
+	}
+	return sector;
+}
+
+/*
+ *  PARAMETERS: sector
+ *
+ *  DESCRIPTION: LPC1788 start address of a flash sector
+ *
+ *  RETURNS: flash address
+ *
+ */
+uint32_t NXPFlashSectorStart(uint32_t sector) {
+	return sectorGeometry[sector].start;
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address to compare
+ *  			ramAddr RAM address to compare
+ *  			size number of bytes
+ *  			pMatch set to 1 when both are equal
+ *
+ *  DESCRIPTION: NXP M command
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCompare(uint32_t flashAddr, uint32_t ramAddr, uint32_t size,
+		uint8_t *pMatch) {
+	const uint32_t args[] = { flashAddr, ramAddr, size };
+	uint32_t start = NXP_CYCLE_COUNT();
+	IspStatus_t status;
+
+	*pMatch = 0;
+	status = NXPIspExecute(ISP_CMD_M, args);
+	if (status == ISP_COMPARE_ERROR) {
+		// followed by the offset of the first mismatch
+		NXPIspNextLine(&stats.cmd[ISP_CMD_M].bytesIn);
+	} else if (status == ISP_CMD_SUCCESS) {
+		*pMatch = 1;
+	} else {
+		return CMD_POB_REJ;
+	}
+	NXPStatsPhase(PHASE_COMPARE, start);
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address of a blank block
+ *  			size number of bytes
+ *  			data the blank block, pEncoded its W blocks or NULL
+ *  			pMatch set to 1 when flash is blank there
+ *
+ *  DESCRIPTION: NXP M command against the FFh block at NXPRAM_BLANK_ADDRESS,
+ *  			written from the blank block itself the first time a block this
+ *  			size is checked in the session
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCompareBlank(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded,
+		uint8_t *pMatch) {
+	uint32_t writeSize = size < NXP_RAM_WRITE_SIZE ? size : NXP_RAM_WRITE_SIZE;
+	uint32_t i;
+
+	if (session.blankStaged < size) {
+		for (i = 0; i < size; i += writeSize) {
+			if (NXPDisplayWriteRAM(NXPRAM_BLANK_ADDRESS + i, data + i,
+					writeSize,
+					pEncoded == NULL ? NULL : &pEncoded[i / writeSize])
+					!= CMD_VALID) {
+				return CMD_POB_REJ;
+			}
+		}
+		session.blankStaged = size;
+	}
+	return NXPDisplayCompare(flashAddr, NXPRAM_BLANK_ADDRESS, size, pMatch);
+}
+
+/*
+ *  PARAMETERS: firstSector, lastSector
+ *
+ *  DESCRIPTION: NXP prepare and erase a range of sectors
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayEraseSectors(uint32_t firstSector, uint32_t lastSector) {
+	const uint32_t args[] = { firstSector, lastSector };
+	uint32_t sector;
+	uint32_t start = NXP_CYCLE_COUNT();
+
+	if (NXPDisplayPrepareRange(firstSector, lastSector) != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
+	if (NXPIspExecute(ISP_CMD_E, args) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
+	session.preparedFirst = SECTOR_NONE;
+	session.preparedLast = SECTOR_NONE;
+	for (sector = firstSector; sector <= lastSector; sector++) {
+		sectorState[sector] = SECTOR_ERASED;
+	}
+	NXPStatsPhase(PHASE_ERASE, start);
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: startAddr first flash address of the image extent
+ *  			endAddr flash address past the image extent
+ *
+ *  DESCRIPTION: erase the sectors covering [startAddr, endAddr) that are not
+ *  			erased yet, each run of them with a single P/E pair. Sectors
+ *  			are erased when the image first reaches them, never up front.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayPlanErase(uint32_t startAddr, uint32_t endAddr) {
+	uint32_t sector;
+	uint32_t lastSector;
+	uint32_t runStart;
+
+	if (endAddr <= startAddr) {
+		return CMD_VALID;
+	}
+	sector = NXPFlashSector(startAddr);
+	lastSector = NXPFlashSector(endAddr - 1);
+	while (sector <= lastSector) {
+		if (sectorState[sector] == SECTOR_ERASED) {
+			sector++;
+			continue;
+		}
+		runStart = sector;
+		while (sector <= lastSector && sectorState[sector] != SECTOR_ERASED) {
+			sector++;
+		}
+		if (NXPDisplayEraseSectors(runStart, sector - 1) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: sectorMask bit n set to erase sector n
+ *
+ *  DESCRIPTION: erase a precomputed sector set, each run of set bits with a
+ *  			single P/E pair
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayEraseMask(uint32_t sectorMask) {
+	uint32_t sector = FIRST_SECTOR;
+	uint32_t runStart;
+
+	while (sector <= MAX_SECTOR) {
+		if ((sectorMask & (1UL << sector)) == 0) {
+			sector++;
+			continue;
+		}
+		runStart = sector;
+		while (sector <= MAX_SECTOR && (sectorMask & (1UL << sector)) != 0) {
+			sector++;
+		}
+		if (NXPDisplayEraseSectors(runStart, sector - 1) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address to copy to
+ *  			ramAddr RAM address to copy from
+ *  			size 256, 512, 1024 or 4096
+ *
+ *  DESCRIPTION: NXP prepare the destination sector and copy from RAM to flash
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCopyBlock(uint32_t flashAddr, uint32_t ramAddr,
+		uint32_t size) {
+	const uint32_t args[] = { flashAddr, ramAddr, size };
+	uint32_t sector = NXPFlashSector(flashAddr);
+	uint32_t start = NXP_CYCLE_COUNT();
+
+	// P command, destination sector only
+	if (NXPDisplayPrepareRange(sector, sector) != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
 
-	int i;
-	for (i = 0; i < BUFFER_SIZE; i++) {
-		byteBuffer[i] = 0xFF;
+	// copy to flash address from RAM address
+	if (NXPIspExecute(ISP_CMD_C, args) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
+	session.preparedFirst = SECTOR_NONE;
+	session.preparedLast = SECTOR_NONE;
+	NXPStatsPhase(PHASE_COPY, start);
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: data, size
+ *
+ *  DESCRIPTION: check a block for erased flash content
+ *
+ *  RETURNS: 1 when all bytes are 0xFF
+ *
+ */
+uint32_t NXPDisplayBlockBlank(const uint8_t *data, uint32_t size) {
+	uint32_t i;
+	for (i = 0; i < size; i++) {
+		if (data[i] != 0xFF) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ *  PARAMETERS: bytes number of bytes to commit
+ *
+ *  DESCRIPTION: smallest C command size holding bytes, at most NXP_COPY_SIZE
+ *
+ *  RETURNS: 256, 512, 1024 or 4096
+ *
+ */
+uint32_t NXPDisplayCopySize(uint32_t bytes) {
+	uint32_t size = 256;
+	while (size < bytes && size < NXP_COPY_SIZE) {
+		size = (size == 1024) ? 4096 : size * 2;
+	}
+	return size;
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address to copy to
+ *  			size bytes to copy, a legal C size up to NXP_COPY_SIZE
+ *
+ *  DESCRIPTION: NXP commit byteBuffer to flash
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCommitBlock(uint32_t flashAddr, uint32_t size) {
+	return NXPDisplayCommitData(flashAddr, size, byteBuffer, NULL);
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address to copy to
+ *  			size bytes to copy, a legal C size up to NXP_COPY_SIZE
+ *  			data block contents
+ *  			pEncoded its W blocks encoded ahead of time, or NULL
+ *
+ *  DESCRIPTION: NXP commit a block to flash, scanning it for blank first
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCommitData(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded) {
+	return NXPDisplayCommitKnown(flashAddr, size, data, pEncoded,
+			NXPDisplayBlockBlank(data, size));
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address to copy to
+ *  			size bytes to copy, a legal C size up to NXP_COPY_SIZE
+ *  			data block contents
+ *  			pEncoded its W blocks encoded ahead of time, or NULL
+ *
+ *  DESCRIPTION: NXP commit a block of a flash plan. The plan only carries
+ *  			blocks that are not blank, they are not scanned again.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCommitPlanned(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded) {
+	return NXPDisplayCommitKnown(flashAddr, size, data, pEncoded, 0);
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address to copy to
+ *  			size bytes to copy, a legal C size up to NXP_COPY_SIZE
+ *  			data block contents
+ *  			pEncoded its W blocks encoded ahead of time, or NULL
+ *  			blank 1 when data is all FFh
+ *
+ *  DESCRIPTION: NXP commit a block to flash, unlock once, write it to the RAM
+ *  			staging area in W blocks, prepare and copy.
+ *  			Blocks are staged at their offset in the sector, so while a
+ *  			sector is unchecked its matching blocks stay in RAM and can be
+ *  			copied again once a later block differs and the sector is erased.
+ *  			A blank block landing on erased flash is skipped without any
+ *  			UART traffic.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCommitKnown(uint32_t flashAddr, uint32_t size,
+		const uint8_t *data, const NXPEncodedBlock_t *pEncoded,
+		uint32_t blank) {
+	uint32_t sector = NXPFlashSector(flashAddr);
+	uint32_t sectorStart = NXPFlashSectorStart(sector);
+	uint32_t ramAddr = NXPRAM_STAGING_ADDRESS + flashAddr - sectorStart;
+	uint32_t writeSize = size < NXP_RAM_WRITE_SIZE ? size : NXP_RAM_WRITE_SIZE;
+	uint32_t block = (flashAddr - sectorStart) / NXP_COPY_SIZE;
+#if NXP_VERIFY_ENABLE
+	// a recopied sector is verified from its start
+	uint32_t verifyFrom = flashAddr;
+#endif
+	uint32_t i;
+
+	// block and ramStaged indexes only hold for flash
+	if (flashAddr >= NXPFLASH_END_ADDRESS
+			|| size > NXPFLASH_END_ADDRESS - flashAddr) {
+		return CMD_POB_REJ;
+	}
+	if (blank) {
+#if !NXP_DIFFERENTIAL_ENABLE
+		// the erase is due anyway, the block itself needs no copy after it
+		if (NXPDisplayPlanErase(flashAddr, flashAddr + size) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+#endif
+		if (sectorState[sector] == SECTOR_ERASED) {
+			stats.blankBlocks++;
+			return CMD_VALID;
+		}
+#if NXP_DIFFERENTIAL_ENABLE
+		// flash already blank there stays as it is, not staged, so a later
+		// erase of the sector leaves it blank as well
+		uint8_t blankFlash = 0;
+		if (sector != FIRST_SECTOR) {
+			if (NXPDisplayCompareBlank(flashAddr, size, data, pEncoded,
+					&blankFlash) != CMD_VALID) {
+				return CMD_POB_REJ;
+			}
+		}
+		if (blankFlash) {
+			stats.blankBlocks++;
+			return CMD_VALID;
+		}
+#endif
 	}
 
 	// U command unlock the flash write/eraze
-	snprintf((char *) sendCmd, sizeof(sendCmd), UNLOCK_CMD);
-	len = NXPDisplayCMDLength(sendCmd);
-	UARTSendWithCR(sendCmd, len);
-	memset(recvBuf, 0, sizeof(recvBuf));
-	UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-	if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
+	if (NXPDisplayUnlock() != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
+
+	// write to RAM address 10000200h onwards
+	if (session.ramSector != sector) {
+		session.ramSector = sector;
+		memset(session.ramStaged, 0, sizeof(session.ramStaged));
+	}
+	for (i = 0; i < size; i += writeSize) {
+		if (NXPDisplayWriteRAM(ramAddr + i, data + i, writeSize,
+				pEncoded == NULL ? NULL : &pEncoded[i / writeSize])
+				!= CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	session.ramStaged[block / 32] |= 1UL << (block % 32);
+
+	if (sectorState[sector] != SECTOR_ERASED) {
+#if NXP_DIFFERENTIAL_ENABLE
+		uint8_t match = 0;
+		// the first 64 bytes of sector 0 read as the boot ROM, always program it
+		if (sector != FIRST_SECTOR) {
+			if (NXPDisplayCompare(flashAddr, ramAddr, size, &match)
+					!= CMD_VALID) {
+				return CMD_POB_REJ;
+			}
+		}
+		if (match) {
+			sectorState[sector] = SECTOR_MATCHED;
+			stats.matchedBlocks++;
+			return CMD_VALID;
+		}
+#endif
+		if (NXPDisplayPlanErase(flashAddr, flashAddr + size) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+		// the blocks of this sector skipped so far are still staged in RAM
+		if (NXPDisplayRecopySector(sector, flashAddr) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+#if NXP_VERIFY_ENABLE
+		verifyFrom = sectorStart;
+#endif
+	}
+
+	if (NXPDisplayCopyBlock(flashAddr, ramAddr, size) != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
+#if NXP_VERIFY_ENABLE
+	return NXPDisplayVerifyBlock(flashAddr, ramAddr, size, verifyFrom);
+#else
+	return CMD_VALID;
+#endif
+}
+
+/*
+ *  PARAMETERS: sector
+ *  			endAddr flash address to stop at
+ *
+ *  DESCRIPTION: NXP copy the blocks of a freshly erased sector below endAddr
+ *  			that are staged in RAM to flash again
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayRecopySector(uint32_t sector, uint32_t endAddr) {
+	uint32_t sectorStart = NXPFlashSectorStart(sector);
+	uint32_t addr;
+	uint32_t i;
+
+	for (addr = sectorStart, i = 0; addr < endAddr;
+			addr += NXP_COPY_SIZE, i++) {
+		if ((session.ramStaged[i / 32] & (1UL << (i % 32))) == 0) {
+			continue;
+		}
+		if (NXPDisplayCopyBlock(addr,
+				NXPRAM_STAGING_ADDRESS + addr - sectorStart, NXP_COPY_SIZE)
+				!= CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: flashAddr flash address just programmed
+ *  			ramAddr RAM copy of the block
+ *  			size number of bytes
+ *  			fromAddr first block of the sector programmed by this commit
+ *
+ *  DESCRIPTION: NXP compare the blocks programmed with their RAM copies.
+ *  			Flash is only programmed again after an erase, so a bad block
+ *  			costs its sector: erase it and copy every block staged for it
+ *  			from RAM again, then compare all of them. Nothing is sent over
+ *  			CAN or UART again but C and M commands.
+ *
+ *  RETURNS: Cmd Status, CMD_POB_REJ when still bad after NXP_RECOMMIT_MAX
+ *
+ */
+uint32_t NXPDisplayVerifyBlock(uint32_t flashAddr, uint32_t ramAddr,
+		uint32_t size, uint32_t fromAddr) {
+	uint32_t sector = NXPFlashSector(flashAddr);
+	uint8_t match = 0;
+	int retry;
+
+	if (NXPDisplayCompareStaged(fromAddr, flashAddr, size, &match)
+			!= CMD_VALID) {
 		return CMD_POB_REJ;
 	}
-	if (strncmp((char *) recvBuf + 1 + len, RESPONSE_ZERO,
-			strlen(RESPONSE_ZERO)) != 0) {
+
+	for (retry = 0; !match && retry < NXP_RECOMMIT_MAX; retry++) {
+		stats.recommits++;
+		if (NXPDisplayEraseSectors(sector, sector) != CMD_VALID
+				|| NXPDisplayRecopySector(sector, flashAddr) != CMD_VALID
+				|| NXPDisplayCopyBlock(flashAddr, ramAddr, size)
+						!= CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+		// everything programmed again is checked again
+		if (NXPDisplayCompareStaged(NXPFlashSectorStart(sector), flashAddr,
+				size, &match) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return match ? CMD_VALID : CMD_POB_REJ;
+}
+
+/*
+ *  PARAMETERS: fromAddr first block to compare
+ *  			flashAddr last block to compare
+ *  			size number of bytes in the last block
+ *  			pMatch set to 1 when all are equal
+ *
+ *  DESCRIPTION: NXP compare the blocks of a sector staged in RAM from
+ *  			fromAddr up to flashAddr with their RAM copies, leaving out
+ *  			the boot ROM vectors
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayCompareStaged(uint32_t fromAddr, uint32_t flashAddr,
+		uint32_t size, uint8_t *pMatch) {
+	uint32_t sectorStart = NXPFlashSectorStart(NXPFlashSector(flashAddr));
+	uint32_t addr;
+	uint32_t skip;
+	uint32_t n;
+	uint32_t i;
+
+	*pMatch = 1;
+	for (addr = fromAddr; *pMatch && addr <= flashAddr;
+			addr += NXP_COPY_SIZE) {
+		i = (addr - sectorStart) / NXP_COPY_SIZE;
+		if (addr < flashAddr
+				&& (session.ramStaged[i / 32] & (1UL << (i % 32))) == 0) {
+			continue;
+		}
+		n = addr == flashAddr ? size : NXP_COPY_SIZE;
+		skip = addr < BOOT_VECTOR_SIZE ? BOOT_VECTOR_SIZE - addr : 0;
+		if (skip >= n) {
+			continue;
+		}
+		if (NXPDisplayCompare(addr + skip,
+				NXPRAM_STAGING_ADDRESS + addr - sectorStart + skip, n - skip,
+				pMatch) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: Command, response
+ *
+ *  DESCRIPTION: NXP Write data Commands. The data goes to its start
+ *  			address, so an image of several segments is sent without
+ *  			its gaps. Blocks only ever go up: data for the block in
+ *  			byteBuffer is merged into it in any order, data for a later
+ *  			block commits it first, data for an earlier one is refused.
+ *
+ *  RETURNS: void
+ *
+ */
+void handleNXPDisplayWrite(uint8_t *pCmd, RspFmt_Obj *pRsp) {
+	uint32_t startAddr;
+	uint32_t sizeInBytes;
+	uint32_t bytesRemain;
+	uint32_t pos;
+	uint8_t *pData;
+
+	// misc init
+	if (NXPDisplayBusy(pRsp)) {
+		return;
+	}
+	NXPStatsStackBase();
+	startAddr = (pCmd[START_ADDR_INDEX] << 24)
+			| (pCmd[START_ADDR_INDEX + 1] << 16)
+			| (pCmd[START_ADDR_INDEX + 2] << 8) | pCmd[START_ADDR_INDEX + 3];
+	sizeInBytes = (pCmd[SIZE_BYTES_INDEX] << 24)
+			| (pCmd[SIZE_BYTES_INDEX + 1] << 16)
+			| (pCmd[SIZE_BYTES_INDEX + 2] << 8) | pCmd[SIZE_BYTES_INDEX + 3];
+	pData = (uint8_t *) &pCmd[DATA_INDEX];
+
+	// only whole words can be swapped back, only inside flash (it starts at
+	// 0) and never into a block already committed, refused before anything
+	// is taken in
+	if ((sizeInBytes % 4) != 0 || (startAddr % 4) != 0
+			|| startAddr > NXPFLASH_END_ADDRESS
+			|| sizeInBytes > NXPFLASH_END_ADDRESS - startAddr
+			|| startAddr - (startAddr % BUFFER_SIZE) < offset) {
+		pRsp->status = CMD_POB_REJ;
+		return;
+	}
+
+	//Byte swap the s record data.  Since the DSP is LE and the SMB is BE,
+	//the SMB byte swaps messgaes when they are received.  However, the s record
+	//is sent in the correct order, so we have to byte swap it again to put it
+	//back in the correct order.
+	//The words are swapped straight into byteBuffer, a chunk of any size is
+	//taken in block by block and every block left behind is committed.
+	while (sizeInBytes > 0) {
+		if (NXPDisplayIngestSeek(startAddr) != CMD_VALID) {
+			// a block failed to commit, the download is over
+			imageOpen = 0;
+			pRsp->status = CMD_POB_REJ;
+			return;
+		}
+		pos = startAddr - offset;
+		bytesRemain = BUFFER_SIZE - pos;
+		if (bytesRemain > sizeInBytes) {
+			bytesRemain = sizeInBytes;
+		}
+		NXPDisplaySwapWords(pData, byteBufferWords + pos / 4,
+				bytesRemain / 4);
+		imageCrc = NXPCrcUpdate(imageCrc, byteBuffer + pos, bytesRemain);
+		imageBytes += bytesRemain;
+		pData += bytesRemain;
+		sizeInBytes -= bytesRemain;
+		startAddr += bytesRemain;
+		if (pos + bytesRemain > curBufferSize) {
+			curBufferSize = pos + bytesRemain;
+		}
+	}
+
+	pRsp->status = CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: Command, response
+ *
+ *  DESCRIPTION: NXP write compressed image data. Same framing as
+ *  			handleNXPDisplayWrite, but the size is the exact number of
+ *  			compressed bytes, the last word may be partly padding. The
+ *  			stream continues across commands from prepare to terminate
+ *  			and is a sequence of tokens:
+ *  			0LLLLLLL                      L + 1 literal bytes follow
+ *  			1LLLLLDD dddddddd [E]         copy L + 3 bytes from DDdddddddd + 1
+ *  			                              back, L of 31 adds an E byte
+ *  			Bytes are decoded straight into byteBuffer and every full block
+ *  			is committed on the way. The stream carries no addresses, it
+ *  			goes on from the end of the data written last.
+ *
+ *  RETURNS: void
+ *
+ */
+void handleNXPDisplayWriteCompressed(uint8_t *pCmd, RspFmt_Obj *pRsp) {
+#if NXP_LZ_ENABLE
+	uint32_t sizeInBytes;
+	uint8_t *pData;
+	uint32_t word;
+	uint32_t i;
+
+	if (NXPDisplayBusy(pRsp)) {
+		return;
+	}
+	NXPStatsStackBase();
+	sizeInBytes = (pCmd[SIZE_BYTES_INDEX] << 24)
+			| (pCmd[SIZE_BYTES_INDEX + 1] << 16)
+			| (pCmd[SIZE_BYTES_INDEX + 2] << 8) | pCmd[SIZE_BYTES_INDEX + 3];
+	pData = (uint8_t *) &pCmd[DATA_INDEX];
+
+	for (i = 0; i < sizeInBytes; i++) {
+		// swapped back a word at a time, like the raw S-record data
+		if ((i % 4) == 0) {
+			NXPDisplaySwapWords(pData + i, &word, 1);
+		}
+		if (NXPLzDecode(((uint8_t *) &word)[i % 4]) != CMD_VALID) {
+			// the stream cannot be picked up again mid token
+			imageOpen = 0;
+			pRsp->status = CMD_POB_REJ;
+			return;
+		}
+	}
+
+	pRsp->status = CMD_VALID;
+#else
+	(void) pCmd;
+	imageOpen = 0;
+	pRsp->status = CMD_POB_REJ;
+#endif
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: commit byteBuffer as a whole block if anything was written
+ *  			to it, the bytes in between stay erased
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayIngestFlush() {
+	if (curBufferSize == 0) {
+		return CMD_VALID;
+	}
+
+	// play tricks with Checksum
+	/*if (offset == 0) {
+		uint32_t chksum = 0;
+		for (i = 0; i < 0x1C; i += 4) {
+			chksum += *(uint8_t *) (byteBuffer + i);
+		}
+		*(uint8_t *) (byteBuffer + 0x1C) = 0xFFFFFFFF - chksum + 1;
+	}*/
+
+	if (NXPDisplayCommitBlock(offset, BUFFER_SIZE) != CMD_VALID) {
 		return CMD_POB_REJ;
 	}
+	NXPDisplayIngestReset();
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: flashAddr where the next data goes
+ *
+ *  DESCRIPTION: make byteBuffer the block holding flashAddr, committing the
+ *  			block it held. Blocks in between are never sent or written.
+ *
+ *  RETURNS: Cmd Status, CMD_POB_REJ for a block below the current one
+ *
+ */
+uint32_t NXPDisplayIngestSeek(uint32_t flashAddr) {
+	uint32_t block = flashAddr - (flashAddr % BUFFER_SIZE);
 
-	// P command prepare the flash sector
-	int firstSector = FIRST_SECTOR;
-	int lastSector = MAX_SECTOR;
-	snprintf((char *) sendCmd, sizeof(sendCmd), PREPARE_SECTOR_CMD, firstSector,
-			lastSector);
-	len = NXPDisplayCMDLength(sendCmd);
-	UARTSendWithCR(sendCmd, len);
-	memset(recvBuf, 0, sizeof(recvBuf));
-	UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-	if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
+	if (block == offset) {
+		return CMD_VALID;
+	}
+	// flash below has been committed, it is not programmed twice
+	if (block < offset || NXPDisplayIngestFlush() != CMD_VALID) {
 		return CMD_POB_REJ;
 	}
-	if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-			strlen(RESPONSE_ZERO)) != 0) {
+	offset = block;
+	NXPJournalUpdate();
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: start a new compressed stream
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPLzReset() {
+	lzDecoder.pos = 0;
+	lzDecoder.state = LZ_CONTROL;
+	lzDecoder.count = 0;
+}
+
+#if NXP_LZ_ENABLE
+/*
+ *  PARAMETERS: c decoded byte
+ *
+ *  DESCRIPTION: append a decoded byte to the window and byteBuffer
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPLzOutput(uint8_t c) {
+	if (curBufferSize == BUFFER_SIZE) {
+		// the stream carries no addresses, it must not run off the flash
+		if (offset + BUFFER_SIZE >= NXPFLASH_END_ADDRESS
+				|| NXPDisplayIngestSeek(offset + BUFFER_SIZE) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	lzDecoder.window[lzDecoder.pos & (LZ_WINDOW_SIZE - 1)] = c;
+	lzDecoder.pos++;
+	byteBuffer[curBufferSize++] = c;
+	imageCrc = NXPCrcUpdate(imageCrc, &c, 1);
+	imageBytes++;
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: c next compressed byte
+ *
+ *  DESCRIPTION: advance the decoder by one byte
+ *
+ *  RETURNS: Cmd Status, CMD_POB_REJ on a match before the stream start
+ *
+ */
+uint32_t NXPLzDecode(uint8_t c) {
+	switch (lzDecoder.state) {
+	case LZ_CONTROL:
+		if (c < LZ_LITERAL_MAX) {
+			lzDecoder.count = c + 1;
+			lzDecoder.state = LZ_LITERAL;
+		} else {
+			lzDecoder.count = ((c >> 2) & 0x1F) + LZ_MATCH_MIN;
+			lzDecoder.distance = (c & 0x03) << 8;
+			lzDecoder.state = LZ_DISTANCE;
+		}
+		return CMD_VALID;
+	case LZ_LITERAL:
+		if (--lzDecoder.count == 0) {
+			lzDecoder.state = LZ_CONTROL;
+		}
+		return NXPLzOutput(c);
+	case LZ_DISTANCE:
+		lzDecoder.distance = (lzDecoder.distance | c) + 1;
+		if (lzDecoder.count == LZ_LENGTH_EXTEND) {
+			lzDecoder.state = LZ_EXTEND;
+			return CMD_VALID;
+		}
+		break;
+	default:
+		lzDecoder.count += c;
+		break;
+	}
+
+	// a complete match, copied byte by byte so it may overlap itself
+	lzDecoder.state = LZ_CONTROL;
+	if (lzDecoder.distance > lzDecoder.pos) {
 		return CMD_POB_REJ;
 	}
-
-	// E command eraze the sectors
-	snprintf((char *) sendCmd, sizeof(sendCmd), ERASE_SECTOR_CMD, firstSector,
-			lastSector);
-	len = NXPDisplayCMDLength(sendCmd);
-	UARTSendWithCR(sendCmd, len);
-	memset(recvBuf, 0, sizeof(recvBuf));
-	UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-	if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-		return CMD_POB_REJ;
+	while (lzDecoder.count > 0) {
+		lzDecoder.count--;
+		if (NXPLzOutput(
+				lzDecoder.window[(lzDecoder.pos - lzDecoder.distance)
+						& (LZ_WINDOW_SIZE - 1)]) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+#endif
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: start an empty block, unwritten bytes stay erased
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPDisplayIngestReset() {
+	curBufferSize = 0;
+	memset(byteBuffer, 0xFF, BUFFER_SIZE);
+}
+
+/*
+ *  PARAMETERS: response
+ *
+ *  DESCRIPTION: NXP write last block of data and terminate
+ *
+ *  RETURNS: void
+ *
+ */
+void handleNXPDisplayTerminate(RspFmt_Obj *pRsp) {
+	if (NXPDisplayBusy(pRsp)) {
+		return;
+	}
+	NXPStatsStackBase();
+	// a compressed stream must not end inside a token
+	if (lzDecoder.state != LZ_CONTROL) {
+		imageOpen = 0;
+		pRsp->status = CMD_POB_REJ;
+		return;
 	}
-	if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-			strlen(RESPONSE_ZERO)) != 0) {
-		return CMD_POB_REJ;
+	if (curBufferSize != 0) {
+		// only as much of the padded block as the tail needs
+		if (NXPDisplayCommitBlock(offset, NXPDisplayCopySize(curBufferSize))
+				!= CMD_VALID) {
+			imageOpen = 0;
+			pRsp->status = CMD_POB_REJ;
+			return;
+		}
+		offset += curBufferSize;
+		curBufferSize = 0;
+		NXPJournalUpdate();
 	}
-
-	return CMD_VALID;
+	// the host checks both against its own image
+	NXPDisplayRspPutWord(pRsp, RSP_CRC_INDEX, imageCrc ^ 0xFFFFFFFF);
+	NXPDisplayRspPutWord(pRsp, RSP_IMAGE_SIZE_INDEX, imageBytes);
+	imageOpen = 0;
+	pRsp->status = CMD_VALID;
 }
 
-
 /*
  *  PARAMETERS: Command, response
  *
- *  DESCRIPTION: NXP Write data Commands
+ *  DESCRIPTION: NXP dump flash. The start address and size come as in
+ *  			handleNXPDisplayWrite, with no data. Connects like prepare, so
+ *  			it is refused from prepare or resume until terminate, or a
+ *  			write that fails and ends the download: a download taken up
+ *  			after a read would lose its staged blocks and sector states. The flash is handed to NXP_DUMP_OUTPUT line
+ *  			by line while it is read, the response carries the CRC-32 and
+ *  			size of the whole range for the host to check what it got. In
+ *  			ISP mode the boot ROM vectors read back in place of the first
+ *  			64 bytes of flash.
  *
  *  RETURNS: void
  *
  */
-void handleNXPDisplayWrite(uint8_t *pCmd, RspFmt_Obj *pRsp) {
-	//uint32_t	startAddr;
+void handleNXPDisplayRead(uint8_t *pCmd, RspFmt_Obj *pRsp) {
+	uint32_t startAddr;
 	uint32_t sizeInBytes;
-	uint32_t bytesRemain;
-	uint32_t aa;
-	uint8_t *pData;
-	uint32_t newData[NUM_PARAMS_MAX];
-
-	// misc init
-	//startAddr = (pCmd[START_ADDR_INDEX] << 24) | (pCmd[START_ADDR_INDEX + 1] << 16) | (pCmd[START_ADDR_INDEX + 2] << 8) | pCmd[START_ADDR_INDEX + 3];
+	uint32_t crc;
 
+	if (NXPDisplayBusy(pRsp)) {
+		return;
+	}
+	NXPStatsStackBase();
+	startAddr = (pCmd[START_ADDR_INDEX] << 24)
+			| (pCmd[START_ADDR_INDEX + 1] << 16)
+			| (pCmd[START_ADDR_INDEX + 2] << 8) | pCmd[START_ADDR_INDEX + 3];
 	sizeInBytes = (pCmd[SIZE_BYTES_INDEX] << 24)
 			| (pCmd[SIZE_BYTES_INDEX + 1] << 16)
 			| (pCmd[SIZE_BYTES_INDEX + 2] << 8) | pCmd[SIZE_BYTES_INDEX + 3];
-	pData = (uint8_t *) &pCmd[DATA_INDEX];
-	//bytesRemain = sizeInBytes;
-
-	// TODO: BUGS!!! It's strange that the raw data will be different with the line of the code below, it doesn't actually do anything...
-	// Need to figure out why...
-	aa = sizeInBytes;
 
-	int paramIndex;
+	// R reads whole words
+	if (imageOpen || (sizeInBytes % 4) != 0 || (startAddr % 4) != 0
+			|| sizeInBytes == 0 || startAddr > NXPFLASH_END_ADDRESS
+			|| sizeInBytes > NXPFLASH_END_ADDRESS - startAddr) {
+		pRsp->status = CMD_POB_REJ;
+		return;
+	}
 
-	//Byte swap the s record data.  Since the DSP is LE and the SMB is BE,
-	//the SMB byte swaps messgaes when they are received.  However, the s record
-	//is sent in the correct order, so we have to byte swap it again to put it
-	//back in the correct order.
-	for (paramIndex = 0; paramIndex < (sizeInBytes / 4); paramIndex++) {
-		newData[paramIndex] = (((uint32_t) pData[(4 * paramIndex) + 3] << 24)
-				+ ((uint32_t) pData[(4 * paramIndex) + 2] << 16)
-				+ ((uint32_t) pData[(4 * paramIndex) + 1] << 8)
-				+ ((uint32_t) pData[(4 * paramIndex) + 0]));
+	NXPDisplayConnect(pRsp);
+	if (pRsp->status != CMD_VALID) {
+		return;
+	}
+	if (NXPDisplayReadFlash(startAddr, sizeInBytes, &crc) != CMD_VALID) {
+		pRsp->status = CMD_POB_REJ;
+		return;
 	}
+	NXPDisplayRspPutWord(pRsp, RSP_CRC_INDEX, crc);
+	NXPDisplayRspPutWord(pRsp, RSP_READ_SIZE_INDEX, sizeInBytes);
+	pRsp->status = CMD_VALID;
+}
 
-	pData = (uint8_t *) &newData;
-	if (curBufferSize + sizeInBytes < BUFFER_SIZE) {
-		memcpy(byteBuffer + curBufferSize, pData, sizeInBytes);
-		curBufferSize += sizeInBytes;
-	} else {
-		// fit exactly 1024 data
-		bytesRemain = BUFFER_SIZE - curBufferSize;
-		memcpy(byteBuffer + curBufferSize, pData, bytesRemain);
+/*
+ *  PARAMETERS: flashAddr first address, word aligned
+ *  			size number of bytes, whole words
+ *  			pCrc CRC-32 of the bytes read dest
+ *
+ *  DESCRIPTION: NXP R command for the whole range. The boot ROM streams it
+ *  			and only waits for the host after the checksum that follows
+ *  			every 20 lines, each line is decoded and handed out while the
+ *  			next one arrives. A group with a garbled line or the wrong
+ *  			checksum is asked for again with RESEND and handed out again at
+ *  			the same addresses, the CRC goes back to the start of the group.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+uint32_t NXPDisplayReadFlash(uint32_t flashAddr, uint32_t size,
+		uint32_t *pCrc) {
+	const uint32_t args[] = { flashAddr, size };
+	uint32_t *pBytesIn = &stats.cmd[ISP_CMD_R].bytesIn;
+	uint8_t data[UUENCODE_MAX_BYTES];
+	uint8_t chksum[ISP_DECIMAL_MAX];
+	uint32_t start = NXP_CYCLE_COUNT();
+	uint32_t endAddr = flashAddr + size;
+	uint32_t groupAddr = flashAddr;
+	uint32_t groupCrc = 0xFFFFFFFF;
+	const char *pAck;
+	uint32_t ackLen;
+	uint32_t addr;
+	uint32_t crc;
+	uint32_t sum;
+	uint32_t num;
+	uint32_t len;
+	uint32_t garbled;
+	uint32_t lines;
+	int retry = 0;
+
+	if (NXPIspExecute(ISP_CMD_R, args) != ISP_CMD_SUCCESS) {
+		return CMD_POB_REJ;
+	}
 
-		// play tricks with Checksum
-		uint32_t chksum = 0;
-		int i;
-		int j;
-		/*if (offset == 0) {
-			for (i = 0; i < 0x1C; i += 4) {
-				chksum += *(uint8_t *) (byteBuffer + i);
+	while (groupAddr < endAddr) {
+		addr = groupAddr;
+		crc = groupCrc;
+		sum = 0;
+		garbled = 0;
+		// the line count is fixed by the size, a garbled line still counts
+		for (lines = 0; lines < ISP_READ_LINES && addr < endAddr; lines++) {
+			if (!NXPIspNextLine(pBytesIn)) {
+				NXPSessionInvalidate();
+				return CMD_POB_REJ;
 			}
-			*(uint8_t *) (byteBuffer + 0x1C) = 0xFFFFFFFF - chksum + 1;
-		}*/
-		chksum = 0;
-
-		for (i = 0; i < ISP_RAM_WRITE_MAX; i++) {
-			chksum += byteBuffer[i];
-		}
-
-		uint8_t sendCmd[NXP_CMD_MAX_LENGTH], recvBuf[LIN_RECV_BUFFER_SIZE];
-		uint32_t len = 0;
-
-		// U command unlock the flash write/eraze
-		snprintf((char *) sendCmd, sizeof(sendCmd), UNLOCK_CMD);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
-
-		//write to RAM address 10000200h, 512 bytes
-		snprintf((char *) sendCmd, sizeof(sendCmd), WRITE_FIRST_RAM_BLOCK);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + 1 + len, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
-
-		int num;
-		// uuencode of the first 512 bytes data
-		for (i = 0; i < ISP_RAM_WRITE_MAX; i += UUENCODE_MAX_BYTES) { // max 45 bytes a time
-			num = ISP_RAM_WRITE_MAX - i;
+			num = endAddr - addr;
 			if (num > UUENCODE_MAX_BYTES) {
 				num = UUENCODE_MAX_BYTES;
 			}
-			sendCmd[0] = num + UUENCODE_OFFSET;
-			for (j = 0; j < num; j += 3)
-				hex2uuencode(byteBuffer + i + j, sendCmd + 1 + (j / 3) * 4);
-			sendCmd[1 + ((num + 2) / 3) * 4] = 0;
-			len = NXPDisplayCMDLength(sendCmd);
-			UARTSendWithCR(sendCmd, len);
-			memset(recvBuf, 0, sizeof(recvBuf));
-			UARTRecv(recvBuf, len);
-			if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-				return;
+			if (NXPDisplayDecodeLine(ispLine.text, ispLine.len, data, &sum)
+					!= num) {
+				garbled = 1;
+			} else if (!garbled) {
+				NXP_DUMP_OUTPUT(addr, data, num);
+				crc = NXPCrcUpdate(crc, data, num);
 			}
+			addr += num;
 		}
 
-		// check-sum
-		snprintf((char *) sendCmd, sizeof(sendCmd), "%d", chksum);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + strlen(RESPONSE_OK) + 1);
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_OK,
-				strlen(RESPONSE_OK)) != 0) {
-			return;
+		// check-sum of the group
+		if (!NXPIspNextLine(pBytesIn)) {
+			NXPSessionInvalidate();
+			return CMD_POB_REJ;
 		}
-
-		// Write to RAM address 10000400h, 512 bytes
-		snprintf((char *) sendCmd, sizeof(sendCmd), WRITE_SECOND_RAM_BLOCK);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + strlen(RESPONSE_ZERO) + 1);
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
+		len = NXPIspFormatDecimal(sum, chksum);
+		if (!garbled && NXPIspLineIs(&ispLine, chksum, len)) {
+			pAck = RESPONSE_OK;
+			groupAddr = addr;
+			groupCrc = crc;
+			retry = 0;
+		} else if (++retry > ISP_RESEND_MAX) {
+			NXPSessionInvalidate();
+			return CMD_POB_REJ;
+		} else {
+			pAck = RESPONSE_RESEND;
+			stats.resends++;
 		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
+		ackLen = strlen(pAck);
+		NXPUartSendWithCR((const uint8_t *) pAck, ackLen);
+		stats.cmd[ISP_CMD_R].bytesOut += ackLen + 1;
+		if (session.echoEnabled && (!NXPIspNextLine(pBytesIn)
+				|| !NXPIspLineIs(&ispLine, pAck, ackLen))) {
+			NXPSessionInvalidate();
+			return CMD_POB_REJ;
 		}
+	}
 
-		chksum = 0;
-		for (i = 0; i < 512; i++) {
-			chksum += byteBuffer[i + 512];
-		}
+	NXPStatsPhase(PHASE_READ, start);
+	*pCrc = groupCrc ^ 0xFFFFFFFF;
+	return CMD_VALID;
+}
 
-		// uuencode of the second 512 bytes data
-		for (i = 0; i < ISP_RAM_WRITE_MAX; i += UUENCODE_MAX_BYTES) { // max 45 bytes a time
-			num = ISP_RAM_WRITE_MAX - i;
-			if (num > UUENCODE_MAX_BYTES) {
-				num = UUENCODE_MAX_BYTES;
-			}
-			sendCmd[0] = num + UUENCODE_OFFSET;
-			for (j = 0; j < num; j += 3)
-				hex2uuencode(byteBuffer + ISP_RAM_WRITE_MAX + i + j,
-						sendCmd + 1 + (j / 3) * 4);
-			sendCmd[1 + ((num + 2) / 3) * 4] = 0;
-			len = NXPDisplayCMDLength(sendCmd);
-			UARTSendWithCR(sendCmd, len);
-			memset(recvBuf, 0, sizeof(recvBuf));
-			UARTRecv(recvBuf, len);
-			if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-				return;
-			}
-		}
+/*
+ *  PARAMETERS: crc running value, 0xFFFFFFFF to start
+ *  			data, size
+ *
+ *  DESCRIPTION: CRC-32 over more data, invert the result once at the end
+ *
+ *  RETURNS: crc
+ *
+ */
+uint32_t NXPCrcUpdate(uint32_t crc, const uint8_t *data, uint32_t size) {
+	uint32_t i;
+	for (i = 0; i < size; i++) {
+		crc = (crc >> 4) ^ crcTable[(crc ^ data[i]) & 0x0F];
+		crc = (crc >> 4) ^ crcTable[(crc ^ (data[i] >> 4)) & 0x0F];
+	}
+	return crc;
+}
 
-		// check-sum
-		snprintf((char *) sendCmd, sizeof(sendCmd), "%d", chksum);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_OK));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_OK,
-				strlen(RESPONSE_OK)) != 0) {
-			return;
-		}
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: empty both UART rings and arm the SCI receive interrupt
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartInit() {
+	NXPUartDrain();
+	uartRx.tail = uartRx.head;
+	ispLine.len = 0;
+	ispLine.complete = 0;
+	if (!uartRx.armed) {
+		uartRx.armed = 1;
+		sciReceive(NXP_SCI_PORT, 1, &uartRx.byte);
+	}
+}
 
-		// P command
-		int firstSector = FIRST_SECTOR;
-		int lastSector = MAX_SECTOR;
-		snprintf((char *) sendCmd, sizeof(sendCmd), PREPARE_SECTOR_CMD,
-				firstSector, lastSector);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: hand the next contiguous run of the TX ring to the SCI
+ *  			driver if it is idle. Called with IRQ disabled or from the
+ *  			SCI interrupt.
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartTxStart() {
+	uint32_t index = uartTx.tail & (UART_TX_RING_SIZE - 1);
+	uint32_t len = uartTx.head - uartTx.tail;
 
-		// copy to flash address (offset) from RAM address 10000200h, 1024 bytes
-		snprintf((char *) sendCmd, sizeof(sendCmd), COPY_FROM_RAM_TO_FLASH,
-				offset);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd,
-				strlen((char *) sendCmd)) != 0) {
-			return;
+	if (uartTx.busy != 0 || len == 0) {
+		return;
+	}
+	if (len > UART_TX_RING_SIZE - index) {
+		len = UART_TX_RING_SIZE - index;
+	}
+	uartTx.busy = len;
+	sciSend(NXP_SCI_PORT, len, &uartTx.data[index]);
+}
+
+/*
+ *  PARAMETERS: buf, len
+ *
+ *  DESCRIPTION: queue bytes for the NXP and return once they are in the TX
+ *  			ring, sleeps only while the ring is full
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartSend(const uint8_t *buf, uint32_t len) {
+	uint32_t index;
+	uint32_t n;
+
+	NXPStatsStack();
+	while (len > 0) {
+		while (uartTx.head - uartTx.tail == UART_TX_RING_SIZE) {
+			NXPUartIdle();
 		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
+		index = uartTx.head & (UART_TX_RING_SIZE - 1);
+		n = UART_TX_RING_SIZE - (uartTx.head - uartTx.tail);
+		if (n > UART_TX_RING_SIZE - index) {
+			n = UART_TX_RING_SIZE - index;
 		}
-
-		// put the remained data to the byteBuffer
-		curBufferSize = 0;
-		for (i = 0; i < BUFFER_SIZE; i++) {
-			byteBuffer[i] = 0xFF;
+		if (n > len) {
+			n = len;
 		}
-		memcpy(byteBuffer + curBufferSize, pData + bytesRemain,
-				sizeInBytes - bytesRemain);
-		offset += 1024;
+		memcpy(&uartTx.data[index], buf, n);
+		buf += n;
+		len -= n;
+		NXP_IRQ_DISABLE();
+		uartTx.head += n;
+		NXPUartTxStart();
+		NXP_IRQ_ENABLE();
 	}
-
-	pRsp->status = CMD_VALID;
 }
 
 /*
- *  PARAMETERS: response
+ *  PARAMETERS: buf, len
  *
- *  DESCRIPTION: NXP write last block of data and terminate
+ *  DESCRIPTION: queue bytes and the CR ending an ISP line
  *
  *  RETURNS: void
  *
  */
-void handleNXPDisplayTerminate(RspFmt_Obj *pRsp) {
-	int i;
-	int j;
-	if (curBufferSize != 0) {
-		uint32_t chksum = 0;
-		chksum = 0;
-		for (i = 0; i < ISP_RAM_WRITE_MAX; i++) {
-			chksum += byteBuffer[i];
-		}
+void NXPUartSendWithCR(const uint8_t *buf, uint32_t len) {
+	uint8_t cr = '\r';
+	NXPUartSend(buf, len);
+	NXPUartSend(&cr, 1);
+}
 
-		uint8_t sendCmd[NXP_CMD_MAX_LENGTH], recvBuf[LIN_RECV_BUFFER_SIZE];
-		uint32_t len = 0;
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: wait until everything queued has left the SCI
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartDrain() {
+	while (uartTx.head != uartTx.tail) {
+		NXPUartIdle();
+	}
+}
 
-		// U command unlock the flash write/eraze
-		snprintf((char *) sendCmd, sizeof(sendCmd), UNLOCK_CMD);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: give the CPU to the rest of the bridge while the NXP or the
+ *  			SCI is busy, then sleep until the next interrupt
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartIdle() {
+	ispIdle = 1;
+	NXP_IDLE_HOOK();
+	ispIdle = 0;
+	NXP_UART_WAIT();
+}
 
-		//write to RAM address 10000200h, 512 bytes
-		snprintf((char *) sendCmd, sizeof(sendCmd), WRITE_FIRST_RAM_BLOCK);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + 1 + len, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
+/*
+ *  PARAMETERS: response
+ *
+ *  DESCRIPTION: refuse an NXP request arriving through NXP_IDLE_HOOK while
+ *  			another one is still talking to the NXP
+ *
+ *  RETURNS: 1 when refused
+ *
+ */
+uint32_t NXPDisplayBusy(RspFmt_Obj *pRsp) {
+	if (ispIdle) {
+		pRsp->status = CMD_POB_REJ;
+		return 1;
+	}
+	return 0;
+}
 
-		int num;
-		// uuencode of the first 512 bytes data
-		for (i = 0; i < ISP_RAM_WRITE_MAX; i += UUENCODE_MAX_BYTES) { // max 45 bytes a time
-			num = ISP_RAM_WRITE_MAX - i;
-			if (num > UUENCODE_MAX_BYTES) {
-				num = UUENCODE_MAX_BYTES;
-			}
-			sendCmd[0] = num + UUENCODE_OFFSET;
-			for (j = 0; j < num; j += 3)
-				hex2uuencode(byteBuffer + i + j, sendCmd + 1 + (j / 3) * 4);
-			sendCmd[1 + ((num + 2) / 3) * 4] = 0;
-			len = NXPDisplayCMDLength(sendCmd);
-			UARTSendWithCR(sendCmd, len);
-			memset(recvBuf, 0, sizeof(recvBuf));
-			UARTRecv(recvBuf, len);
-			if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-				return;
-			}
-		}
+/*
+ *  PARAMETERS: baud
+ *
+ *  DESCRIPTION: change the local UART rate once the TX ring has drained
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartSetBaudRate(uint32_t baud) {
+	NXPUartDrain();
+	sciSetBaudrate(NXP_SCI_PORT, baud);
+}
 
-		// check-sum
-		snprintf((char *) sendCmd, sizeof(sendCmd), "%d", chksum);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + strlen(RESPONSE_OK) + 1);
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_OK,
-				strlen(RESPONSE_OK)) != 0) {
-			return;
+/*
+ *  PARAMETERS: sci port, flags SCI_TX_INT or SCI_RX_INT
+ *
+ *  DESCRIPTION: SCI interrupt side of the UART rings, to be called from
+ *  			sciNotification for NXP_SCI_PORT
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPUartNotification(sciBASE_t *sci, uint32_t flags) {
+	if (sci != NXP_SCI_PORT) {
+		return;
+	}
+	if ((flags & SCI_RX_INT) != 0) {
+		if (uartRx.head - uartRx.tail < UART_RX_RING_SIZE) {
+			uartRx.data[uartRx.head & (UART_RX_RING_SIZE - 1)] = uartRx.byte;
+			uartRx.head++;
+		} else {
+			uartRx.overruns++;
 		}
+		sciReceive(NXP_SCI_PORT, 1, &uartRx.byte);
+	}
+	if ((flags & SCI_TX_INT) != 0) {
+		uartTx.tail += uartTx.busy;
+		uartTx.busy = 0;
+		NXPUartTxStart();
+	}
+}
 
-		chksum = 0;
-		for (i = 0; i < 512; i++) {
-			chksum += byteBuffer[i + 512];
-		}
+/*
+ *  PARAMETERS: cmd ISP command
+ *  			bytesOut, bytesIn bytes on the wire each way
+ *  			start NXP_CYCLE_COUNT when the command was sent
+ *  			status Cmd Status
+ *
+ *  DESCRIPTION: count one ISP command and its round trip
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPStatsCommand(IspCmd_t cmd, uint32_t bytesOut, uint32_t bytesIn,
+		uint32_t start, uint32_t status) {
+#if NXP_STATS_ENABLE
+	IspCmdStats_t *pCmd = &stats.cmd[cmd];
+	uint32_t cycles = NXP_CYCLE_COUNT() - start;
+
+	if (pCmd->count == 0 || cycles < pCmd->minCycles) {
+		pCmd->minCycles = cycles;
+	}
+	if (cycles > pCmd->maxCycles) {
+		pCmd->maxCycles = cycles;
+	}
+	pCmd->count++;
+	pCmd->totalCycles += cycles;
+	pCmd->bytesOut += bytesOut;
+	pCmd->bytesIn += bytesIn;
+	if (status != CMD_VALID) {
+		pCmd->errors++;
+	}
+#endif
+}
 
-		// Write to RAM address 10000400h, 512 bytes
-		snprintf((char *) sendCmd, sizeof(sendCmd), WRITE_SECOND_RAM_BLOCK);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + strlen(RESPONSE_ZERO) + 1);
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
+/*
+ *  PARAMETERS: phase
+ *  			start NXP_CYCLE_COUNT when the phase began
+ *
+ *  DESCRIPTION: add the time since start to a phase
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPStatsPhase(IspPhase_t phase, uint32_t start) {
+#if NXP_STATS_ENABLE
+	stats.phaseCycles[phase] += NXP_CYCLE_COUNT() - start;
+	stats.phaseCount[phase]++;
+#endif
+}
 
-		// uuencode of the second 512 bytes data
-		for (i = 0; i < ISP_RAM_WRITE_MAX; i += UUENCODE_MAX_BYTES) { // max 45 bytes a time
-			num = ISP_RAM_WRITE_MAX - i;
-			if (num > UUENCODE_MAX_BYTES) {
-				num = UUENCODE_MAX_BYTES;
-			}
-			sendCmd[0] = num + UUENCODE_OFFSET;
-			for (j = 0; j < num; j += 3)
-				hex2uuencode(byteBuffer + ISP_RAM_WRITE_MAX + i + j,
-						sendCmd + 1 + (j / 3) * 4);
-			sendCmd[1 + ((num + 2) / 3) * 4] = 0;
-			len = NXPDisplayCMDLength(sendCmd);
-			UARTSendWithCR(sendCmd, len);
-			memset(recvBuf, 0, sizeof(recvBuf));
-			UARTRecv(recvBuf, len);
-			if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-				return;
-			}
-		}
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: note the stack at a handler entry, NXPStatsStack measures
+ *  			from here. The handler's own frame is not counted.
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPStatsStackBase() {
+#if NXP_STATS_ENABLE
+	volatile uint8_t mark;
+	stackBase = (uintptr_t) &mark;
+#endif
+}
 
-		// check-sum
-		snprintf((char *) sendCmd, sizeof(sendCmd), "%d", chksum);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_OK));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_OK,
-				strlen(RESPONSE_OK)) != 0) {
-			return;
-		}
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: keep the deepest stack seen below the handler entry. Called
+ *  			where every ISP exchange ends up, sending and waiting for a
+ *  			line, so it catches the deepest call chains.
+ *
+ *  RETURNS: void
+ *
+ */
+void NXPStatsStack() {
+#if NXP_STATS_ENABLE
+	volatile uint8_t mark;
+	uint32_t depth = (uint32_t) (stackBase - (uintptr_t) &mark);
+
+	if (stackBase != 0 && depth > stats.stackPeak
+			&& depth < NXP_STACK_DEPTH_MAX) {
+		stats.stackPeak = depth;
+	}
+#endif
+}
 
-		// P command
-		int firstSector = FIRST_SECTOR;
-		int lastSector = MAX_SECTOR;
-		snprintf((char *) sendCmd, sizeof(sendCmd), PREPARE_SECTOR_CMD,
-				firstSector, lastSector);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd, len) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
+/*
+ *  PARAMETERS: Command, response
+ *
+ *  DESCRIPTION: NXP read one instrumentation record, optionally clearing all
+ *  			of them afterwards.
+ *  			ISP command record: count, errors, bytes out, bytes in,
+ *  			min, avg, max round trip cycles.
+ *  			Phase record: cycles high word, cycles low word, entries.
+ *  			Event record: RESENDs, handshake retries, blank blocks skipped,
+ *  			blocks matching flash, response timeouts, sectors programmed
+ *  			again after a failed verify, ? sent again, sessions reused.
+ *  			Footprint record: RAM bytes of the block buffers and UART
+ *  			rings, the part NXP_LOW_RAM_ENABLE shrinks, deepest stack bytes
+ *  			seen below a handler, 1 for a low RAM build. The map file has
+ *  			the rest of the static RAM.
+ *  			Deadline record: smoothed cycles and deviation per unit of
+ *  			work, for each IspClass_t.
+ *
+ *  RETURNS: void
+ *
+ */
+void handleNXPDisplayStats(uint8_t *pCmd, RspFmt_Obj *pRsp) {
+	uint32_t record = pCmd[STATS_RECORD_INDEX];
+	IspCmdStats_t *pCmdStats;
+
+	if (record < STATS_RECORD_PHASE) {
+		pCmdStats = &stats.cmd[record];
+		NXPDisplayRspPutWord(pRsp, 0, pCmdStats->count);
+		NXPDisplayRspPutWord(pRsp, 4, pCmdStats->errors);
+		NXPDisplayRspPutWord(pRsp, 8, pCmdStats->bytesOut);
+		NXPDisplayRspPutWord(pRsp, 12, pCmdStats->bytesIn);
+		NXPDisplayRspPutWord(pRsp, 16, pCmdStats->minCycles);
+		NXPDisplayRspPutWord(pRsp, 20,
+				pCmdStats->count == 0 ?
+						0 : (uint32_t) (pCmdStats->totalCycles / pCmdStats->count));
+		NXPDisplayRspPutWord(pRsp, 24, pCmdStats->maxCycles);
+	} else if (record < STATS_RECORD_EVENTS) {
+		record -= STATS_RECORD_PHASE;
+		NXPDisplayRspPutWord(pRsp, 0,
+				(uint32_t) (stats.phaseCycles[record] >> 32));
+		NXPDisplayRspPutWord(pRsp, 4, (uint32_t) stats.phaseCycles[record]);
+		NXPDisplayRspPutWord(pRsp, 8, stats.phaseCount[record]);
+	} else if (record == STATS_RECORD_EVENTS) {
+		NXPDisplayRspPutWord(pRsp, 0, stats.resends);
+		NXPDisplayRspPutWord(pRsp, 4, stats.handshakeRetries);
+		NXPDisplayRspPutWord(pRsp, 8, stats.blankBlocks);
+		NXPDisplayRspPutWord(pRsp, 12, stats.matchedBlocks);
+		NXPDisplayRspPutWord(pRsp, 16, stats.timeouts);
+		NXPDisplayRspPutWord(pRsp, 20, stats.recommits);
+		NXPDisplayRspPutWord(pRsp, 24, stats.syncRetries);
+		NXPDisplayRspPutWord(pRsp, 28, stats.warmSessions);
+	} else if (record == STATS_RECORD_FOOTPRINT) {
+		NXPDisplayRspPutWord(pRsp, 0, sizeof(byteBufferWords)
+#if !NXP_LOW_RAM_ENABLE
+				+ sizeof(encodedBlock)
+#endif
+				+ sizeof(uartTx) + sizeof(uartRx));
+		NXPDisplayRspPutWord(pRsp, 4, stats.stackPeak);
+		NXPDisplayRspPutWord(pRsp, 8, NXP_LOW_RAM_ENABLE);
+	} else if (record == STATS_RECORD_DEADLINE) {
+		for (record = 0; record < ISP_CLASS_COUNT; record++) {
+			NXPDisplayRspPutWord(pRsp, 8 * record, deadlines[record].srtt);
+			NXPDisplayRspPutWord(pRsp, 8 * record + 4,
+					deadlines[record].rttvar);
 		}
+	} else {
+		pRsp->status = CMD_POB_REJ;
+		return;
+	}
 
-		// copy to flash address (offset) from RAM address 10000200h, 1024 bytes
-		snprintf((char *) sendCmd, sizeof(sendCmd), COPY_FROM_RAM_TO_FLASH,
-				offset);
-		len = NXPDisplayCMDLength(sendCmd);
-		UARTSendWithCR(sendCmd, len);
-		memset(recvBuf, 0, sizeof(recvBuf));
-		UARTRecv(recvBuf, len + 1 + strlen(RESPONSE_ZERO));
-		if (strncmp((char *) recvBuf, (char *) sendCmd,
-				strlen((char *) sendCmd)) != 0) {
-			return;
-		}
-		if (strncmp((char *) recvBuf + len + 1, RESPONSE_ZERO,
-				strlen(RESPONSE_ZERO)) != 0) {
-			return;
-		}
+	if (pCmd[STATS_CLEAR_INDEX] != 0) {
+		memset(&stats, 0, sizeof(stats));
 	}
 	pRsp->status = CMD_VALID;
 }
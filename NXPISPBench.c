@@ -0,0 +1,419 @@
+// Codec microbenchmarks for NXPISP.c
+// Times the uuencode, uudecode, ISP checksum and S-record byte swap paths on 1 KB
+// blocks and on a full 512 KB image, against the scalar code they replaced,
+// and cross-checks both produce the same output:
+//
+//   gcc -O2 -o NXPISPBench NXPISPBench.c && ./NXPISPBench
+//
+// Exits non zero on any mismatch.
+
+
+//
+// INCLUDED FILES
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "NXPISPHost.h"
+
+// nothing is ever received, never wait
+#define NXP_UART_WAIT()
+
+#include "NXPISP.c"
+
+//
+// LOCAL DEFINITIONS, MACROS, AND TYPEDEFS
+//
+#define BENCH_BLOCK_SIZE (1024)
+#define BENCH_IMAGE_SIZE (0x80000)
+
+// repeat each run until it has taken at least this long
+#define BENCH_MIN_NS (200000000.0)
+
+// reference line, 45 bytes encoded plus slack for the old tail over-read
+typedef struct {
+	uint8_t line[UUENCODE_LINES_MAX][UUENCODE_LINE_MAX + 4];
+} RefBlock_t;
+
+typedef struct {
+	double ns;
+	double cycles;
+} BenchTime_t;
+
+//
+// STATIC VARIABLE DEFINITIONS
+//
+int canREG2Port;
+sciBASE_t sciLinPort;
+
+// image plus slack, the reference encoder reads past the end of a line
+static uint8_t image[BENCH_IMAGE_SIZE + 64];
+static uint32_t swapped[BENCH_IMAGE_SIZE / 4];
+static uint32_t swappedRef[BENCH_IMAGE_SIZE / 4];
+static UUEncodeBlock_t block;
+static RefBlock_t refBlock;
+
+// results are folded in here so the compiler keeps the work
+static volatile uint32_t sink;
+
+//
+// START OF OPERATIONAL CODE
+//
+
+void canIoSetPort(int *port, uint32_t bit, uint32_t value) {
+	(void) port;
+	(void) bit;
+	(void) value;
+}
+
+void canDumpOutput(uint32_t addr, const uint8_t *data, uint32_t len) {
+	(void) addr;
+	(void) data;
+	(void) len;
+}
+
+void sciSend(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	(void) length;
+	(void) data;
+	NXPUartNotification(sci, SCI_TX_INT);
+}
+
+void sciReceive(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	(void) sci;
+	(void) length;
+	(void) data;
+}
+
+void sciSetBaudrate(sciBASE_t *sci, uint32_t baud) {
+	(void) sci;
+	(void) baud;
+}
+
+uint32_t NXPHostCycles(void) {
+	return 0;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: monotonic time
+ *
+ *  RETURNS: nanoseconds
+ *
+ */
+static double BenchNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: CPU cycle counter where there is one
+ *
+ *  RETURNS: cycles, 0 when not available
+ *
+ */
+static uint64_t BenchCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ *  PARAMETERS: data, size
+ *  			pRef reference lines dest
+ *
+ *  DESCRIPTION: the scalar encoder the W path used before, one hex2uuencode
+ *  			call per 3 bytes and strlen per line
+ *
+ *  RETURNS: sum of the line lengths
+ *
+ */
+static uint32_t RefEncodeBlock(uint8_t *data, uint32_t size, RefBlock_t *pRef) {
+	uint32_t i;
+	uint32_t j;
+	uint32_t num;
+	uint32_t len = 0;
+	uint8_t *line;
+
+	for (i = 0; i < size; i += UUENCODE_MAX_BYTES) {
+		num = size - i;
+		if (num > UUENCODE_MAX_BYTES) {
+			num = UUENCODE_MAX_BYTES;
+		}
+		line = pRef->line[i / UUENCODE_MAX_BYTES];
+		line[0] = num + UUENCODE_OFFSET;
+		for (j = 0; j < num; j += 3)
+			hex2uuencode(data + i + j, line + 1 + (j / 3) * 4);
+		line[1 + ((num + 2) / 3) * 4] = 0;
+		len += NXPDisplayCMDLength(line);
+	}
+	return len;
+}
+
+/*
+ *  PARAMETERS: data, size
+ *
+ *  DESCRIPTION: the scalar ISP checksum
+ *
+ *  RETURNS: checksum
+ *
+ */
+static uint32_t RefChecksum(const uint8_t *data, uint32_t size) {
+	uint32_t chksum = 0;
+	uint32_t i;
+	for (i = 0; i < size; i++) {
+		chksum += data[i];
+	}
+	return chksum;
+}
+
+/*
+ *  PARAMETERS: src, dest, words
+ *
+ *  DESCRIPTION: the byte swap loop as it was in handleNXPDisplayWrite
+ *
+ *  RETURNS: void
+ *
+ */
+static void RefSwapWords(const uint8_t *pData, uint32_t *newData,
+		uint32_t words) {
+	uint32_t paramIndex;
+	for (paramIndex = 0; paramIndex < words; paramIndex++) {
+		newData[paramIndex] = (((uint32_t) pData[(4 * paramIndex) + 3] << 24)
+				+ ((uint32_t) pData[(4 * paramIndex) + 2] << 16)
+				+ ((uint32_t) pData[(4 * paramIndex) + 1] << 8)
+				+ ((uint32_t) pData[(4 * paramIndex) + 0]));
+	}
+}
+
+/*
+ *  PARAMETERS: pBlock encoded lines
+ *  			data bytes they were encoded from, size
+ *
+ *  DESCRIPTION: the decoder gives back the bytes and checksum of every
+ *  			line, and refuses the line with a char outside the alphabet
+ *
+ *  RETURNS: number of mismatches
+ *
+ */
+static uint32_t BenchDecodeCheck(UUEncodeBlock_t *pBlock, const uint8_t *data,
+		uint32_t size) {
+	uint8_t decoded[UUENCODE_MAX_BYTES];
+	uint32_t errors = 0;
+	uint32_t chksum = 0;
+	uint32_t num;
+	uint32_t i;
+	uint8_t c;
+
+	for (i = 0; i < pBlock->lineCount; i++) {
+		num = NXPDisplayDecodeLine(pBlock->line[i], pBlock->lineLen[i],
+				decoded, &chksum);
+		if (num == 0 || memcmp(decoded, data + i * UUENCODE_MAX_BYTES, num)
+				!= 0) {
+			printf("line %u decodes differently, %u bytes\n", i, size);
+			errors++;
+		}
+	}
+	if (chksum != pBlock->chksum) {
+		printf("decoded checksum differs, %u bytes\n", size);
+		errors++;
+	}
+	c = pBlock->line[0][1];
+	pBlock->line[0][1] = 'a';
+	if (NXPDisplayDecodeLine(pBlock->line[0], pBlock->lineLen[0], decoded,
+			&chksum) != 0) {
+		printf("garbled line decoded, %u bytes\n", size);
+		errors++;
+	}
+	pBlock->line[0][1] = c;
+	return errors;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: encoder, checksum and swap give the same results as the
+ *  			scalar code, for every tail length, and the decoder gives
+ *  			back what was encoded. The reference encoder reads past a
+ *  			short tail, so it is fed a zero padded copy.
+ *
+ *  RETURNS: number of mismatches
+ *
+ */
+static uint32_t BenchCrossCheck() {
+	uint8_t padded[ISP_RAM_WRITE_MAX + 64];
+	uint32_t errors = 0;
+	uint32_t size;
+	uint32_t base;
+	uint32_t i;
+
+	for (size = 4; size <= ISP_RAM_WRITE_MAX; size += 4) {
+		for (base = 0; base + ISP_RAM_WRITE_MAX <= BENCH_IMAGE_SIZE;
+				base += 64 * 1024 + 12) {
+			memset(padded, 0, sizeof(padded));
+			memcpy(padded, image + base, size);
+			NXPDisplayEncodeBlock(image + base, size, &block);
+			RefEncodeBlock(padded, size, &refBlock);
+			if (block.chksum != RefChecksum(image + base, size)) {
+				printf("checksum differs, %u bytes at %u\n", size, base);
+				errors++;
+			}
+			if (block.lineCount
+					!= (size + UUENCODE_MAX_BYTES - 1) / UUENCODE_MAX_BYTES) {
+				printf("line count differs, %u bytes\n", size);
+				errors++;
+				continue;
+			}
+			for (i = 0; i < block.lineCount; i++) {
+				if (strcmp((char *) block.line[i], (char *) refBlock.line[i])
+						!= 0
+						|| block.lineLen[i]
+								!= NXPDisplayCMDLength(refBlock.line[i])) {
+					printf("line %u differs, %u bytes at %u\n", i, size, base);
+					errors++;
+				}
+			}
+			errors += BenchDecodeCheck(&block, image + base, size);
+		}
+	}
+
+	NXPDisplaySwapWords(image, swapped, BENCH_IMAGE_SIZE / 4);
+	RefSwapWords(image, swappedRef, BENCH_IMAGE_SIZE / 4);
+	if (memcmp(swapped, swappedRef, sizeof(swapped)) != 0) {
+		printf("byte swap differs\n");
+		errors++;
+	}
+	return errors;
+}
+
+/*
+ *  PARAMETERS: pBlock encoded lines
+ *
+ *  DESCRIPTION: decode every line of a block as R data is
+ *
+ *  RETURNS: ISP checksum of the block
+ *
+ */
+static uint32_t BenchDecodeBlock(const UUEncodeBlock_t *pBlock) {
+	uint8_t decoded[UUENCODE_MAX_BYTES];
+	uint32_t chksum = 0;
+	uint32_t i;
+
+	for (i = 0; i < pBlock->lineCount; i++) {
+		NXPDisplayDecodeLine(pBlock->line[i], pBlock->lineLen[i], decoded,
+				&chksum);
+	}
+	return chksum;
+}
+
+/*
+ *  PARAMETERS: name, bytes per run, elapsed time of one run
+ *
+ *  DESCRIPTION: print one result line
+ *
+ *  RETURNS: void
+ *
+ */
+static void BenchReport(const char *name, uint32_t bytes, BenchTime_t t) {
+	printf("%-28s %10.1f ns/KB %8.1f MB/s", name, t.ns * 1024.0 / bytes,
+			bytes * 1000.0 / t.ns);
+	if (t.cycles > 0) {
+		printf(" %7.3f bytes/cycle", bytes / t.cycles);
+	}
+	printf("\n");
+}
+
+/*
+ *  PARAMETERS: which kernel, size bytes per run
+ *
+ *  DESCRIPTION: run a kernel over the image in size pieces until
+ *  			BENCH_MIN_NS has passed
+ *
+ *  RETURNS: time of one run over size bytes
+ *
+ */
+static BenchTime_t BenchRun(int which, uint32_t size) {
+	BenchTime_t t;
+	double start = BenchNow();
+	uint64_t cycles = BenchCycles();
+	uint32_t runs = 0;
+	uint32_t base = 0;
+	uint32_t i;
+
+	do {
+		for (i = 0; i < size; i += ISP_RAM_WRITE_MAX) {
+			uint8_t *p = image + base + i;
+			switch (which) {
+			case 0:
+				NXPDisplayEncodeBlock(p, ISP_RAM_WRITE_MAX, &block);
+				sink += block.chksum;
+				break;
+			case 1:
+				sink += RefEncodeBlock(p, ISP_RAM_WRITE_MAX, &refBlock);
+				sink += RefChecksum(p, ISP_RAM_WRITE_MAX);
+				break;
+			case 2:
+				sink += RefChecksum(p, ISP_RAM_WRITE_MAX);
+				break;
+			case 3:
+				NXPDisplayEncodeBlock(p, ISP_RAM_WRITE_MAX, &block);
+				sink += BenchDecodeBlock(&block);
+				break;
+			case 4:
+				NXPDisplaySwapWords(p, swapped, ISP_RAM_WRITE_MAX / 4);
+				sink += swapped[0];
+				break;
+			default:
+				RefSwapWords(p, swappedRef, ISP_RAM_WRITE_MAX / 4);
+				sink += swappedRef[0];
+				break;
+			}
+		}
+		base = (base + size) % BENCH_IMAGE_SIZE;
+		runs++;
+	} while (BenchNow() - start < BENCH_MIN_NS);
+
+	t.ns = (BenchNow() - start) / runs;
+	t.cycles = (double) (BenchCycles() - cycles) / runs;
+	return t;
+}
+
+int main() {
+	static const char *names[] = { "encode+checksum (table)",
+			"encode+checksum (scalar)", "checksum (scalar)",
+			"encode+decode+checksum", "byte swap", "byte swap (scalar)" };
+	static const uint32_t sizes[] = { BENCH_BLOCK_SIZE, BENCH_IMAGE_SIZE };
+	uint32_t errors;
+	uint32_t s;
+	int which;
+
+	srand(1);
+	for (s = 0; s < BENCH_IMAGE_SIZE; s++) {
+		image[s] = rand() & 0xFF;
+	}
+
+	errors = BenchCrossCheck();
+	printf("cross-check %s\n", errors == 0 ? "ok" : "FAILED");
+	if (errors != 0) {
+		return 1;
+	}
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf("\n%u bytes per run\n", sizes[s]);
+		for (which = 0; which < 6; which++) {
+			BenchReport(names[which], sizes[s], BenchRun(which, sizes[s]));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,815 @@
+// Parallel flasher for NXPISP.c
+// Flashes one image into the LPC1788 on every serial port given, all boards
+// at once. Each port gets a worker process running the bridge ISP sequence
+// (handshake, version check, unlock, erase, write, copy) as is; NXPISP.c
+// keeps its session in statics, so a board failing or hanging never
+// touches the others. The parent only collects progress:
+//
+//   gcc -O2 -o NXPISPFlash NXPISPFlash.c
+//   ./NXPISPFlash image.bin /dev/ttyUSB0 /dev/ttyUSB1 ...
+//
+// DTR drives the NXP reset and RTS holds the ISP entry pin low while reset
+// is released. A board passes when the bridge's CRC-32 of what it took in
+// matches the image. Exits non zero when any board failed.
+//
+// Given a plan from NXPISPPlan instead of an image, the plan is mapped once
+// and shared by every worker: the erase set goes first, then only the
+// non-blank blocks, their W blocks sent as the pre-encoded text. A board
+// then passes when every block compared equal after its copy.
+//
+//   ./NXPISPFlash -d bytes dump.bin port
+//
+// dumps that many bytes of flash from address 0 into dump.bin instead. The
+// bridge hands the flash out line by line as the R data comes in, each line
+// is written at its address straight away, and the dump passes when the
+// file's CRC-32 matches the bridge's.
+
+
+//
+// INCLUDED FILES
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "NXPISPHost.h"
+
+// the worker sleeps in poll until the port has bytes or a tick passes
+void FlashWait(void);
+#define NXP_UART_WAIT() FlashWait()
+
+#include "NXPISP.c"
+
+//
+// LOCAL DEFINITIONS, MACROS, AND TYPEDEFS
+//
+#define FLASH_PORTS_MAX (64)
+#define FLASH_IMAGE_MAX (0x80000)
+#define FLASH_CHUNK (4096)
+#define FLASH_TICK_MS (10)
+#define FLASH_RESET_MS (50)
+#define FLASH_LINE_MAX (64)
+
+typedef enum {
+	PORT_RUNNING, PORT_DONE, PORT_FAILED
+} PortState_t;
+
+// one board as seen by the parent
+typedef struct {
+	const char *name;
+	pid_t pid;
+	int progress;
+	PortState_t state;
+	uint32_t done;
+	uint32_t reported;
+	double startMs;
+	double endMs;
+	char line[FLASH_LINE_MAX];
+	uint32_t lineLen;
+	char detail[FLASH_LINE_MAX];
+} FlashPort_t;
+
+//
+// STATIC VARIABLE DEFINITIONS
+//
+static FlashPort_t ports[FLASH_PORTS_MAX];
+static uint8_t image[FLASH_IMAGE_MAX];
+
+// mapped flash plan, NULL when flashing an image
+static const uint8_t *plan;
+static const PlanHeader_t *planHeader;
+
+// dump file, -1 when flashing
+static int dumpFd = -1;
+
+// worker side
+static int portFd = -1;
+static int portReport = -1;
+static int portInReset = 0;
+static uint8_t *portRxDest;
+
+int canREG2Port;
+sciBASE_t sciLinPort;
+
+//
+// START OF OPERATIONAL CODE
+//
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: monotonic time
+ *
+ *  RETURNS: milliseconds
+ *
+ */
+static double FlashNowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP_CYCLE_COUNT on the host
+ *
+ *  RETURNS: microseconds
+ *
+ */
+uint32_t NXPHostCycles(void) {
+	return (uint32_t) (FlashNowMs() * 1000.0);
+}
+
+/*
+ *  PARAMETERS: ms
+ *
+ *  DESCRIPTION: sleep
+ *
+ *  RETURNS: void
+ *
+ */
+static void FlashSleepMs(uint32_t ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+/*
+ *  PARAMETERS: baud
+ *
+ *  DESCRIPTION: termios speed of a baud rate
+ *
+ *  RETURNS: speed, B0 when not supported
+ *
+ */
+static speed_t FlashSpeed(uint32_t baud) {
+	switch (baud) {
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+#ifdef B460800
+	case 460800: return B460800;
+#endif
+	default: return B0;
+	}
+}
+
+/*
+ *  PARAMETERS: bits TIOCM_DTR, TIOCM_RTS
+ *  			set 1 to assert
+ *
+ *  DESCRIPTION: drive the modem lines, ignored on ports without them
+ *
+ *  RETURNS: void
+ *
+ */
+static void FlashModemLines(int bits, int set) {
+	ioctl(portFd, set ? TIOCMBIS : TIOCMBIC, &bits);
+}
+
+void canIoSetPort(int *port, uint32_t bit, uint32_t value) {
+	(void) port;
+	(void) bit;
+	if (value == 0) {
+		FlashModemLines(TIOCM_DTR | TIOCM_RTS, 1);
+		portInReset = 1;
+	} else if (portInReset) {
+		// boot into the ISP handler, then free the pin for the application
+		FlashSleepMs(FLASH_RESET_MS);
+		FlashModemLines(TIOCM_DTR, 0);
+		FlashSleepMs(FLASH_RESET_MS);
+		FlashModemLines(TIOCM_RTS, 0);
+		tcflush(portFd, TCIFLUSH);
+		portInReset = 0;
+	}
+}
+
+void canDumpOutput(uint32_t addr, const uint8_t *data, uint32_t len) {
+	if (pwrite(dumpFd, data, len, addr) != (ssize_t) len) {
+		// the CRC check at the end fails
+		return;
+	}
+	if ((addr + len) / FLASH_CHUNK != addr / FLASH_CHUNK) {
+		dprintf(portReport, "%u\n", addr + len);
+	}
+}
+
+void sciSend(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	ssize_t n;
+	while (length > 0) {
+		n = write(portFd, data, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// a dead port shows up as response timeouts
+			break;
+		}
+		data += n;
+		length -= n;
+	}
+	NXPUartNotification(sci, SCI_TX_INT);
+}
+
+void sciReceive(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	(void) sci;
+	(void) length;
+	portRxDest = data;
+}
+
+void sciSetBaudrate(sciBASE_t *sci, uint32_t baud) {
+	struct termios tio;
+	speed_t speed = FlashSpeed(baud);
+
+	(void) sci;
+	if (speed == B0 || tcgetattr(portFd, &tio) != 0) {
+		return;
+	}
+	tcdrain(portFd);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	tcsetattr(portFd, TCSANOW, &tio);
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP_UART_WAIT, feed what the port has through the SCI
+ *  			receive interrupt path or let one tick pass
+ *
+ *  RETURNS: void
+ *
+ */
+void FlashWait(void) {
+	struct pollfd pfd = { portFd, POLLIN, 0 };
+	uint8_t buf[256];
+	uint8_t *dest;
+	ssize_t n;
+	ssize_t i;
+
+	if (poll(&pfd, 1, FLASH_TICK_MS) <= 0) {
+		return;
+	}
+	n = read(portFd, buf, sizeof(buf));
+	if (n <= 0) {
+		// hung up, do not spin on it
+		FlashSleepMs(FLASH_TICK_MS);
+		return;
+	}
+	for (i = 0; i < n && portRxDest != NULL; i++) {
+		dest = portRxDest;
+		portRxDest = NULL;
+		*dest = buf[i];
+		NXPUartNotification(scilinREG, SCI_RX_INT);
+	}
+}
+
+/*
+ *  PARAMETERS: name serial port
+ *
+ *  DESCRIPTION: open a port raw 8N1 at the boot ROM rate, NXP held in reset
+ *
+ *  RETURNS: 0 on success
+ *
+ */
+static int FlashOpen(const char *name) {
+	struct termios tio;
+
+	portFd = open(name, O_RDWR | O_NOCTTY);
+	if (portFd < 0 || tcgetattr(portFd, &tio) != 0) {
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, FlashSpeed(NXP_BAUD_DEFAULT));
+	cfsetospeed(&tio, FlashSpeed(NXP_BAUD_DEFAULT));
+	if (tcsetattr(portFd, TCSANOW, &tio) != 0) {
+		return -1;
+	}
+	canIoSetPort(canREG2, 1, 0);
+	return 0;
+}
+
+/*
+ *  PARAMETERS: pRsp, index
+ *
+ *  DESCRIPTION: a word put with NXPDisplayRspPutWord
+ *
+ *  RETURNS: word
+ *
+ */
+static uint32_t FlashRspWord(const RspFmt_Obj *pRsp, uint32_t index) {
+	return ((uint32_t) pRsp->data[index] << 24)
+			| ((uint32_t) pRsp->data[index + 1] << 16)
+			| ((uint32_t) pRsp->data[index + 2] << 8) | pRsp->data[index + 3];
+}
+
+/*
+ *  PARAMETERS: name serial port
+ *  			size image bytes
+ *  			report pipe to the parent
+ *
+ *  DESCRIPTION: worker, flash the image the way the CAN host drives the
+ *  			bridge: prepare, write chunks, terminate. Reports bytes
+ *  			written after every chunk and ok or fail at the end.
+ *
+ *  RETURNS: exit status
+ *
+ */
+static int FlashPortRun(const char *name, uint32_t size, int report) {
+	static uint8_t cmd[DATA_INDEX + FLASH_CHUNK];
+	RspFmt_Obj rsp;
+	uint32_t done;
+	uint32_t crc;
+	uint32_t n;
+
+	if (FlashOpen(name) != 0) {
+		dprintf(report, "fail open: %s\n", strerror(errno));
+		return 1;
+	}
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayPrepare(&rsp);
+	if (rsp.status != CMD_VALID) {
+		dprintf(report, "fail prepare\n");
+		return 1;
+	}
+	for (done = 0; done < size; done += n) {
+		n = size - done;
+		if (n > FLASH_CHUNK) {
+			n = FLASH_CHUNK;
+		}
+		cmd[START_ADDR_INDEX] = (done >> 24) & 0xFF;
+		cmd[START_ADDR_INDEX + 1] = (done >> 16) & 0xFF;
+		cmd[START_ADDR_INDEX + 2] = (done >> 8) & 0xFF;
+		cmd[START_ADDR_INDEX + 3] = done & 0xFF;
+		cmd[SIZE_BYTES_INDEX] = (n >> 24) & 0xFF;
+		cmd[SIZE_BYTES_INDEX + 1] = (n >> 16) & 0xFF;
+		cmd[SIZE_BYTES_INDEX + 2] = (n >> 8) & 0xFF;
+		cmd[SIZE_BYTES_INDEX + 3] = n & 0xFF;
+		// the bridge swaps every word back, on a little endian host that
+		// leaves the bytes as they are
+		memcpy(cmd + DATA_INDEX, image + done, n);
+		rsp.status = CMD_POB_REJ;
+		handleNXPDisplayWrite(cmd, &rsp);
+		if (rsp.status != CMD_VALID) {
+			dprintf(report, "fail write at %u\n", done);
+			return 1;
+		}
+		dprintf(report, "%u\n", done + n);
+	}
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayTerminate(&rsp);
+	if (rsp.status != CMD_VALID) {
+		dprintf(report, "fail terminate\n");
+		return 1;
+	}
+	crc = NXPCrcUpdate(0xFFFFFFFF, image, size) ^ 0xFFFFFFFF;
+	if (FlashRspWord(&rsp, RSP_CRC_INDEX) != crc
+			|| FlashRspWord(&rsp, RSP_IMAGE_SIZE_INDEX) != size) {
+		dprintf(report, "fail image CRC %08X, bridge took %08X\n", crc,
+				FlashRspWord(&rsp, RSP_CRC_INDEX));
+		return 1;
+	}
+	dprintf(report, "ok, CRC %08X\n", crc);
+	return 0;
+}
+
+/*
+ *  PARAMETERS: name serial port
+ *  			report progress pipe
+ *
+ *  DESCRIPTION: worker, flash the mapped plan: erase its sector set, then
+ *  			commit every block from the map. Reports bytes done after
+ *  			every block and ok or fail at the end.
+ *
+ *  RETURNS: exit status
+ *
+ */
+static int FlashPlanRun(const char *name, int report) {
+	NXPEncodedBlock_t encoded[NXP_COPY_SIZE / NXP_RAM_WRITE_SIZE];
+	const PlanBlock_t *pBlock;
+	const PlanChunk_t *pChunk;
+	RspFmt_Obj rsp;
+	uint32_t count;
+	uint32_t done;
+	uint32_t i;
+	uint32_t j;
+
+	if (FlashOpen(name) != 0) {
+		dprintf(report, "fail open: %s\n", strerror(errno));
+		return 1;
+	}
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayPrepare(&rsp);
+	if (rsp.status != CMD_VALID) {
+		dprintf(report, "fail prepare\n");
+		return 1;
+	}
+	if (NXPDisplayEraseMask(planHeader->eraseMask) != CMD_VALID) {
+		dprintf(report, "fail erase\n");
+		return 1;
+	}
+	pBlock = (const PlanBlock_t *) (plan + planHeader->blockOffset);
+	for (i = 0; i < planHeader->blockCount; i++, pBlock++) {
+		pChunk = (const PlanChunk_t *) (plan + planHeader->chunkOffset)
+				+ pBlock->firstChunk;
+		count = pBlock->size < NXP_RAM_WRITE_SIZE ?
+				1 : pBlock->size / NXP_RAM_WRITE_SIZE;
+		for (j = 0; j < count; j++) {
+			encoded[j].text = plan + pChunk[j].textOffset;
+			encoded[j].len = pChunk[j].textLen;
+			encoded[j].chksum = pChunk[j].chksum;
+		}
+		if (NXPDisplayCommitPlanned(pBlock->flashAddr, pBlock->size,
+				plan + pBlock->dataOffset,
+				(planHeader->flags & PLAN_FLAG_ENCODED) ? encoded : NULL)
+				!= CMD_VALID) {
+			dprintf(report, "fail write at %u\n", pBlock->flashAddr);
+			return 1;
+		}
+		done = pBlock->flashAddr + pBlock->size;
+		dprintf(report, "%u\n",
+				done < planHeader->imageSize ? done : planHeader->imageSize);
+	}
+	dprintf(report, "ok, plan CRC %08X\n", planHeader->imageCrc);
+	return 0;
+}
+
+/*
+ *  PARAMETERS: name serial port
+ *  			size bytes from address 0
+ *  			report pipe to the parent
+ *
+ *  DESCRIPTION: worker, dump the flash the way the CAN host would, with
+ *  			one read command for all of it. Reports bytes written as they
+ *  			land in the file, then checks the file's CRC against the
+ *  			bridge's.
+ *
+ *  RETURNS: exit status
+ *
+ */
+static int FlashDumpRun(const char *name, uint32_t size, int report) {
+	uint8_t cmd[DATA_INDEX];
+	RspFmt_Obj rsp;
+	uint32_t crc;
+
+	portReport = report;
+	if (FlashOpen(name) != 0) {
+		dprintf(report, "fail open: %s\n", strerror(errno));
+		return 1;
+	}
+	cmd[START_ADDR_INDEX] = cmd[START_ADDR_INDEX + 1] = 0;
+	cmd[START_ADDR_INDEX + 2] = cmd[START_ADDR_INDEX + 3] = 0;
+	cmd[SIZE_BYTES_INDEX] = (size >> 24) & 0xFF;
+	cmd[SIZE_BYTES_INDEX + 1] = (size >> 16) & 0xFF;
+	cmd[SIZE_BYTES_INDEX + 2] = (size >> 8) & 0xFF;
+	cmd[SIZE_BYTES_INDEX + 3] = size & 0xFF;
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayRead(cmd, &rsp);
+	if (rsp.status != CMD_VALID) {
+		dprintf(report, "fail read\n");
+		return 1;
+	}
+	if (pread(dumpFd, image, size, 0) != (ssize_t) size) {
+		dprintf(report, "fail dump file: %s\n", strerror(errno));
+		return 1;
+	}
+	crc = NXPCrcUpdate(0xFFFFFFFF, image, size) ^ 0xFFFFFFFF;
+	if (FlashRspWord(&rsp, RSP_CRC_INDEX) != crc
+			|| FlashRspWord(&rsp, RSP_READ_SIZE_INDEX) != size) {
+		dprintf(report, "fail file CRC %08X, bridge read %08X\n", crc,
+				FlashRspWord(&rsp, RSP_CRC_INDEX));
+		return 1;
+	}
+	dprintf(report, "ok, CRC %08X\n", crc);
+	return 0;
+}
+
+/*
+ *  PARAMETERS: name plan or image file
+ *
+ *  DESCRIPTION: map a flash plan and check it fits this build and its own
+ *  			size before any worker reads it
+ *
+ *  RETURNS: 1 mapped, 0 not a plan, -1 a bad plan
+ *
+ */
+static int FlashPlanMap(const char *name) {
+	const PlanBlock_t *pBlock;
+	const PlanChunk_t *pChunk;
+	struct stat st;
+	uint64_t fileSize;
+	uint32_t end;
+	uint32_t i;
+	uint32_t magic = 0;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (read(fd, &magic, sizeof(magic)) != sizeof(magic)
+			|| magic != PLAN_MAGIC) {
+		close(fd);
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(PlanHeader_t)) {
+		printf("%s: short plan\n", name);
+		close(fd);
+		return -1;
+	}
+	fileSize = (uint64_t) st.st_size;
+	plan = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (plan == MAP_FAILED) {
+		printf("%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	planHeader = (const PlanHeader_t *) plan;
+	if (planHeader->version != PLAN_VERSION
+			|| planHeader->copySize != NXP_COPY_SIZE
+			|| planHeader->writeSize != NXP_RAM_WRITE_SIZE) {
+		printf("%s: plan version %u for %u/%u byte blocks, "
+				"this build takes version %u and %u/%u\n", name,
+				planHeader->version, planHeader->copySize,
+				planHeader->writeSize, PLAN_VERSION, NXP_COPY_SIZE,
+				NXP_RAM_WRITE_SIZE);
+		return -1;
+	}
+	if (planHeader->fileSize != fileSize || planHeader->imageSize == 0
+			|| planHeader->imageSize > FLASH_IMAGE_MAX
+			|| planHeader->blockOffset
+					+ (uint64_t) planHeader->blockCount * sizeof(PlanBlock_t)
+					> fileSize
+			|| planHeader->chunkOffset
+					+ (uint64_t) planHeader->chunkCount * sizeof(PlanChunk_t)
+					> fileSize) {
+		printf("%s: truncated or corrupt plan\n", name);
+		return -1;
+	}
+	// every block and its text inside the file, workers trust the map
+	pBlock = (const PlanBlock_t *) (plan + planHeader->blockOffset);
+	for (i = 0; i < planHeader->blockCount; i++, pBlock++) {
+		end = pBlock->size < NXP_RAM_WRITE_SIZE ?
+				1 : pBlock->size / NXP_RAM_WRITE_SIZE;
+		if (pBlock->size != NXPDisplayCopySize(pBlock->size)
+				|| pBlock->flashAddr % NXP_COPY_SIZE != 0
+				|| pBlock->flashAddr + pBlock->size > FLASH_IMAGE_MAX
+				|| pBlock->dataOffset + (uint64_t) pBlock->size > fileSize
+				|| pBlock->firstChunk + (uint64_t) end
+						> planHeader->chunkCount) {
+			printf("%s: bad block %u\n", name, i);
+			return -1;
+		}
+	}
+	pChunk = (const PlanChunk_t *) (plan + planHeader->chunkOffset);
+	for (i = 0; i < planHeader->chunkCount; i++, pChunk++) {
+		if (pChunk->textOffset + (uint64_t) pChunk->textLen > fileSize) {
+			printf("%s: bad chunk %u\n", name, i);
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/*
+ *  PARAMETERS: pPort, line one report line from its worker
+ *  			size image bytes
+ *
+ *  DESCRIPTION: parent, track a worker report and print every 10 %
+ *
+ *  RETURNS: void
+ *
+ */
+static void FlashPortLine(FlashPort_t *pPort, const char *line, uint32_t size) {
+	if (strncmp(line, "fail", 4) == 0) {
+		snprintf(pPort->detail, sizeof(pPort->detail), "%s", line + 5);
+	} else if (strncmp(line, "ok", 2) == 0) {
+		snprintf(pPort->detail, sizeof(pPort->detail), "%s", line);
+	} else {
+		pPort->done = strtoul(line, NULL, 10);
+		if (pPort->done * 10ULL / size != pPort->reported) {
+			pPort->reported = pPort->done * 10ULL / size;
+			printf("%-20s %3u%%\n", pPort->name, pPort->reported * 10);
+			fflush(stdout);
+		}
+	}
+}
+
+/*
+ *  PARAMETERS: pPort
+ *  			size image bytes
+ *
+ *  DESCRIPTION: parent, take in what a worker has written, collect it once
+ *  			its pipe closes
+ *
+ *  RETURNS: void
+ *
+ */
+static void FlashPortRead(FlashPort_t *pPort, uint32_t size) {
+	char buf[256];
+	ssize_t n;
+	ssize_t i;
+	int status;
+
+	n = read(pPort->progress, buf, sizeof(buf));
+	if (n < 0 && errno == EINTR) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (buf[i] == '\n') {
+			pPort->line[pPort->lineLen] = 0;
+			FlashPortLine(pPort, pPort->line, size);
+			pPort->lineLen = 0;
+		} else if (pPort->lineLen < FLASH_LINE_MAX - 1) {
+			pPort->line[pPort->lineLen++] = buf[i];
+		}
+	}
+	if (n > 0) {
+		return;
+	}
+
+	close(pPort->progress);
+	pPort->progress = -1;
+	pPort->endMs = FlashNowMs();
+	waitpid(pPort->pid, &status, 0);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		pPort->state = PORT_DONE;
+	} else {
+		pPort->state = PORT_FAILED;
+		if (WIFSIGNALED(status)) {
+			snprintf(pPort->detail, sizeof(pPort->detail), "killed by signal %d",
+					WTERMSIG(status));
+		} else if (pPort->detail[0] == 0) {
+			snprintf(pPort->detail, sizeof(pPort->detail), "exit %d",
+					WEXITSTATUS(status));
+		}
+	}
+}
+
+/*
+ *  PARAMETERS: name image file
+ *  			pSize image bytes, dest
+ *
+ *  DESCRIPTION: read a binary image into image
+ *
+ *  RETURNS: 0 on success
+ *
+ */
+static int FlashLoad(const char *name, uint32_t *pSize) {
+	FILE *f;
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		printf("%s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	memset(image, 0xFF, sizeof(image));
+	*pSize = fread(image, 1, sizeof(image), f);
+	fclose(f);
+	if (*pSize == 0) {
+		printf("%s: empty or unreadable\n", name);
+		return 1;
+	}
+	// whole words, the pad stays erased
+	*pSize = (*pSize + 3) & ~3U;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct pollfd pfds[FLASH_PORTS_MAX];
+	FlashPort_t *pPort;
+	uint32_t count;
+	uint32_t size;
+	uint32_t failed = 0;
+	uint32_t live;
+	uint32_t i;
+	int first = 2;
+	int fds[2];
+	int mapped = 0;
+
+	if (argc == 5 && strcmp(argv[1], "-d") == 0) {
+		size = strtoul(argv[2], NULL, 0);
+		if (size == 0 || (size % 4) != 0 || size > FLASH_IMAGE_MAX) {
+			printf("dump size must be whole words, at most %u bytes\n",
+					FLASH_IMAGE_MAX);
+			return 2;
+		}
+		dumpFd = open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (dumpFd < 0) {
+			printf("%s: %s\n", argv[3], strerror(errno));
+			return 2;
+		}
+		first = 4;
+	} else if (argc < 3 || argc - 2 > FLASH_PORTS_MAX || argv[1][0] == '-') {
+		printf("usage: %s image.bin|image.plan port [port ...]\n"
+				"       %s -d bytes dump.bin port\n", argv[0], argv[0]);
+		return 2;
+	} else {
+		mapped = FlashPlanMap(argv[1]);
+		if (mapped < 0) {
+			return 2;
+		}
+		if (mapped) {
+			size = planHeader->imageSize;
+		} else if (FlashLoad(argv[1], &size) != 0) {
+			return 2;
+		}
+	}
+
+	count = argc - first;
+	for (i = 0; i < count; i++) {
+		pPort = &ports[i];
+		pPort->name = argv[i + first];
+		pPort->startMs = FlashNowMs();
+		if (pipe(fds) != 0) {
+			pPort->state = PORT_FAILED;
+			snprintf(pPort->detail, sizeof(pPort->detail), "pipe: %s",
+					strerror(errno));
+			continue;
+		}
+		fflush(stdout);
+		pPort->pid = fork();
+		if (pPort->pid == 0) {
+			close(fds[0]);
+			if (dumpFd >= 0) {
+				_exit(FlashDumpRun(pPort->name, size, fds[1]));
+			}
+			_exit(mapped ? FlashPlanRun(pPort->name, fds[1])
+					: FlashPortRun(pPort->name, size, fds[1]));
+		}
+		close(fds[1]);
+		if (pPort->pid < 0) {
+			close(fds[0]);
+			pPort->state = PORT_FAILED;
+			snprintf(pPort->detail, sizeof(pPort->detail), "fork: %s",
+					strerror(errno));
+			continue;
+		}
+		pPort->progress = fds[0];
+		pPort->state = PORT_RUNNING;
+	}
+
+	// one event loop over every worker's progress pipe
+	for (;;) {
+		live = 0;
+		for (i = 0; i < count; i++) {
+			if (ports[i].state == PORT_RUNNING) {
+				pfds[live].fd = ports[i].progress;
+				pfds[live].events = POLLIN;
+				pfds[live].revents = 0;
+				live++;
+			}
+		}
+		if (live == 0) {
+			break;
+		}
+		if (poll(pfds, live, -1) < 0 && errno != EINTR) {
+			break;
+		}
+		live = 0;
+		for (i = 0; i < count; i++) {
+			if (ports[i].state != PORT_RUNNING) {
+				continue;
+			}
+			if (pfds[live++].revents != 0) {
+				FlashPortRead(&ports[i], size);
+			}
+		}
+	}
+
+	printf("\n%-20s %-6s %8s  %s\n", "port", "result", "seconds", "detail");
+	for (i = 0; i < count; i++) {
+		pPort = &ports[i];
+		if (pPort->state != PORT_DONE) {
+			failed++;
+		}
+		printf("%-20s %-6s %8.2f  %s\n", pPort->name,
+				pPort->state == PORT_DONE ? "ok" : "FAILED",
+				pPort->endMs > 0 ? (pPort->endMs - pPort->startMs) / 1000.0 : 0,
+				pPort->detail);
+	}
+	printf("%u of %u boards %s, %u bytes each\n", count - failed, count,
+			dumpFd >= 0 ? "dumped" : "flashed", size);
+	return failed == 0 ? 0 : 1;
+}
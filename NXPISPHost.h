@@ -0,0 +1,107 @@
+// Host stand-ins for the bridge firmware headers NXPISP.c is built against,
+// shared by the host tools that include NXPISP.c directly, and the flash plan
+// file format NXPISPPlan writes and NXPISPFlash streams
+
+#ifndef NXPISPHOST_H_
+#define NXPISPHOST_H_
+
+//
+// INCLUDED FILES
+//
+#include <stdint.h>
+
+//
+// BRIDGE STAND-INS
+//
+typedef struct {
+	uint32_t status;
+	uint8_t data[64];
+	uint32_t numBytes;
+} RspFmt_Obj;
+
+#define CMD_VALID (0)
+#define CMD_POB_REJ (1)
+
+#define LIN_RECV_BUFFER_SIZE (100)
+#define NUM_PARAMS_MAX (64)
+
+extern int canREG2Port;
+#define canREG2 (&canREG2Port)
+
+void canIoSetPort(int *port, uint32_t bit, uint32_t value);
+
+// CAN queue for handleNXPDisplayRead, each piece of flash with its address
+void canDumpOutput(uint32_t addr, const uint8_t *data, uint32_t len);
+
+// HALCoGen SCI driver in interrupt mode
+typedef struct {
+	uint32_t id;
+} sciBASE_t;
+
+#define SCI_TX_INT (0x00000100U)
+#define SCI_RX_INT (0x00000200U)
+
+extern sciBASE_t sciLinPort;
+#define scilinREG (&sciLinPort)
+
+void sciSend(sciBASE_t *sci, uint32_t length, uint8_t *data);
+void sciReceive(sciBASE_t *sci, uint32_t length, uint8_t *data);
+void sciSetBaudrate(sciBASE_t *sci, uint32_t baud);
+
+// PMU cycle counter stand-in, each host tool picks its own time base and
+// counts in microseconds
+uint32_t NXPHostCycles(void);
+#define NXP_CYCLE_COUNT() NXPHostCycles()
+#define NXP_CPU_HZ (1000000)
+
+// single threaded, the SCI stand-in calls back synchronously
+#define NXP_IRQ_DISABLE()
+#define NXP_IRQ_ENABLE()
+
+//
+// FLASH PLAN FILE
+//
+// Little endian, every offset counts from the start of the file:
+//   PlanHeader_t
+//   PlanBlock_t[blockCount]  non-blank blocks in flash order
+//   PlanChunk_t[chunkCount]  the W blocks of every block, in block order
+//   block data, each block padded to its C size
+//   encoded text, the uuencode lines of every W block each ending in CR
+#define PLAN_MAGIC (0x4C50584EUL)	// "NXPL"
+#define PLAN_VERSION (1)
+
+// the plan carries encoded text
+#define PLAN_FLAG_ENCODED (0x00000001U)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t copySize;		// NXP_COPY_SIZE the blocks were cut for
+	uint32_t writeSize;		// NXP_RAM_WRITE_SIZE the chunks were cut for
+	uint32_t imageSize;		// whole words from address 0
+	uint32_t imageCrc;		// CRC-32 of the image, as the bridge reports it
+	uint32_t eraseMask;		// bit n set, erase sector n
+	uint32_t blockCount;
+	uint32_t chunkCount;
+	uint32_t blockOffset;
+	uint32_t chunkOffset;
+	uint32_t dataOffset;
+	uint32_t textOffset;
+	uint32_t fileSize;
+} PlanHeader_t;
+
+typedef struct {
+	uint32_t flashAddr;
+	uint32_t size;			// C size, 256 up to copySize
+	uint32_t dataOffset;
+	uint32_t firstChunk;	// size / writeSize chunks from here
+} PlanBlock_t;
+
+typedef struct {
+	uint32_t textOffset;
+	uint32_t textLen;		// 0 without encoded text
+	uint32_t chksum;		// ISP W checksum of the chunk
+} PlanChunk_t;
+
+#endif /* NXPISPHOST_H_ */
@@ -0,0 +1,393 @@
+// Flash plan compiler for NXPISP.c
+// Does ahead of time, once per image, the work the bridge repeats on every
+// board: lays an S-record or binary image out in flash, pads it to copy
+// blocks, drops the blank ones, works out the sector erase set, the W block
+// checksums and the uuencode lines. NXPISPFlash memory-maps the plan and
+// streams it with no per-byte work:
+//
+//   gcc -O2 -o NXPISPPlan NXPISPPlan.c
+//   ./NXPISPPlan [-n] image.srec|image.bin image.plan
+//
+// -n leaves the encoded text out, the plan is then less than half the size and
+// the flasher encodes at flash time. Blocks are cut for the NXP_COPY_SIZE
+// and NXP_RAM_WRITE_SIZE NXPISP.c is built with, the flasher refuses a plan
+// cut for other sizes.
+
+
+//
+// INCLUDED FILES
+//
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "NXPISPHost.h"
+
+// nothing is ever sent to a target, never wait
+#define NXP_UART_WAIT()
+
+#include "NXPISP.c"
+
+//
+// LOCAL DEFINITIONS, MACROS, AND TYPEDEFS
+//
+#define PLAN_IMAGE_MAX (0x80000)
+#define PLAN_SREC_LINE_MAX (520)
+
+// worst case text of one W block, every line full plus its CR
+#define PLAN_CHUNK_TEXT_MAX (UUENCODE_LINES_MAX * (UUENCODE_LINE_MAX + 1))
+
+#define PLAN_BLOCKS_MAX (PLAN_IMAGE_MAX / 256)
+#define PLAN_CHUNKS_MAX (PLAN_IMAGE_MAX / 256)
+
+//
+// STATIC VARIABLE DEFINITIONS
+//
+int canREG2Port;
+sciBASE_t sciLinPort;
+
+static uint8_t image[PLAN_IMAGE_MAX];
+static PlanBlock_t blocks[PLAN_BLOCKS_MAX];
+static PlanChunk_t chunks[PLAN_CHUNKS_MAX];
+static UUEncodeBlock_t block;
+
+//
+// START OF OPERATIONAL CODE
+//
+
+void canIoSetPort(int *port, uint32_t bit, uint32_t value) {
+	(void) port;
+	(void) bit;
+	(void) value;
+}
+
+void canDumpOutput(uint32_t addr, const uint8_t *data, uint32_t len) {
+	(void) addr;
+	(void) data;
+	(void) len;
+}
+
+void sciSend(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	(void) length;
+	(void) data;
+	NXPUartNotification(sci, SCI_TX_INT);
+}
+
+void sciReceive(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	(void) sci;
+	(void) length;
+	(void) data;
+}
+
+void sciSetBaudrate(sciBASE_t *sci, uint32_t baud) {
+	(void) sci;
+	(void) baud;
+}
+
+uint32_t NXPHostCycles(void) {
+	return 0;
+}
+
+/*
+ *  PARAMETERS: text, count hex digits
+ *
+ *  DESCRIPTION: parse count hex digits
+ *
+ *  RETURNS: value, -1 on a bad digit
+ *
+ */
+static int64_t PlanHex(const char *text, uint32_t count) {
+	int64_t value = 0;
+	uint32_t i;
+	char c;
+
+	for (i = 0; i < count; i++) {
+		c = text[i];
+		value <<= 4;
+		if (c >= '0' && c <= '9') {
+			value |= c - '0';
+		} else if (c >= 'A' && c <= 'F') {
+			value |= c - 'A' + 10;
+		} else if (c >= 'a' && c <= 'f') {
+			value |= c - 'a' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return value;
+}
+
+/*
+ *  PARAMETERS: f open S-record file
+ *  			pEnd flash address past the highest byte, dest
+ *
+ *  DESCRIPTION: lay S1, S2 and S3 data records out in image, check every
+ *  			record checksum. Other record types carry no data.
+ *
+ *  RETURNS: 0 on success
+ *
+ */
+static int PlanReadSrec(FILE *f, uint32_t *pEnd) {
+	char line[PLAN_SREC_LINE_MAX];
+	uint32_t lineNo = 0;
+	uint32_t addrLen;
+	uint32_t count;
+	uint32_t addr;
+	uint32_t len;
+	uint8_t sum;
+	int64_t v;
+	uint32_t i;
+
+	*pEnd = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineNo++;
+		len = strcspn(line, "\r\n");
+		if (len == 0) {
+			continue;
+		}
+		v = len >= 4 && line[0] == 'S' ? PlanHex(line + 2, 2) : -1;
+		if (v < 0 || len != 4 + 2 * (uint32_t) v) {
+			printf("line %u: not an S-record\n", lineNo);
+			return 1;
+		}
+		count = v;
+		sum = count;
+		for (i = 0; i < count; i++) {
+			v = PlanHex(line + 4 + 2 * i, 2);
+			if (v < 0) {
+				printf("line %u: bad hex\n", lineNo);
+				return 1;
+			}
+			sum += v;
+		}
+		if (sum != 0xFF) {
+			printf("line %u: bad checksum\n", lineNo);
+			return 1;
+		}
+		switch (line[1]) {
+		case '1':
+			addrLen = 2;
+			break;
+		case '2':
+			addrLen = 3;
+			break;
+		case '3':
+			addrLen = 4;
+			break;
+		default:
+			continue;
+		}
+		if (count < addrLen + 1) {
+			printf("line %u: short record\n", lineNo);
+			return 1;
+		}
+		addr = PlanHex(line + 4, 2 * addrLen);
+		count -= addrLen + 1;
+		if (addr > PLAN_IMAGE_MAX || count > PLAN_IMAGE_MAX - addr) {
+			printf("line %u: 0x%08X past the end of flash\n", lineNo, addr);
+			return 1;
+		}
+		for (i = 0; i < count; i++) {
+			image[addr + i] = PlanHex(line + 4 + 2 * (addrLen + i), 2);
+		}
+		if (addr + count > *pEnd) {
+			*pEnd = addr + count;
+		}
+	}
+	return 0;
+}
+
+/*
+ *  PARAMETERS: name image file
+ *  			pSize image bytes, dest
+ *
+ *  DESCRIPTION: load an S-record or binary image into image, whole words
+ *  			from address 0 with the rest left erased
+ *
+ *  RETURNS: 0 on success
+ *
+ */
+static int PlanLoad(const char *name, uint32_t *pSize) {
+	FILE *f = fopen(name, "rb");
+	int c;
+	int err = 0;
+
+	if (f == NULL) {
+		printf("%s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	memset(image, 0xFF, sizeof(image));
+	c = fgetc(f);
+	ungetc(c, f);
+	if (c == 'S') {
+		err = PlanReadSrec(f, pSize);
+	} else {
+		*pSize = fread(image, 1, sizeof(image), f);
+		if (fgetc(f) != EOF) {
+			printf("%s: larger than flash\n", name);
+			err = 1;
+		}
+	}
+	fclose(f);
+	if (err == 0 && *pSize == 0) {
+		printf("%s: empty or unreadable\n", name);
+		err = 1;
+	}
+	*pSize = (*pSize + 3) & ~3U;
+	return err;
+}
+
+/*
+ *  PARAMETERS: f plan file
+ *  			data, size
+ *
+ *  DESCRIPTION: write all of it
+ *
+ *  RETURNS: 0 on success
+ *
+ */
+static int PlanPut(FILE *f, const void *data, uint32_t size) {
+	return fwrite(data, 1, size, f) == size ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+	static uint8_t text[PLAN_CHUNK_TEXT_MAX];
+	PlanHeader_t header;
+	PlanBlock_t *pBlock;
+	uint32_t encoded = 1;
+	uint32_t dataSize = 0;
+	uint32_t textSize = 0;
+	uint32_t chunkSize;
+	uint32_t size;
+	uint32_t addr;
+	uint32_t len;
+	uint32_t i;
+	uint32_t j;
+	uint32_t k;
+	FILE *f;
+	int arg = 1;
+
+	if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+		encoded = 0;
+		arg++;
+	}
+	if (argc - arg != 2) {
+		printf("usage: %s [-n] image.srec|image.bin image.plan\n", argv[0]);
+		return 2;
+	}
+	if (PlanLoad(argv[arg], &size) != 0) {
+		return 2;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PLAN_MAGIC;
+	header.version = PLAN_VERSION;
+	header.flags = encoded ? PLAN_FLAG_ENCODED : 0;
+	header.copySize = NXP_COPY_SIZE;
+	header.writeSize = NXP_RAM_WRITE_SIZE;
+	header.imageSize = size;
+	header.imageCrc = NXPCrcUpdate(0xFFFFFFFF, image, size) ^ 0xFFFFFFFF;
+
+	// every sector the image covers, a blank block there must read blank
+	for (i = NXPFlashSector(0); i <= NXPFlashSector(size - 1); i++) {
+		header.eraseMask |= 1UL << i;
+	}
+
+	// blocks as the bridge would commit them, the tail only as large as it
+	// needs to be; blank ones are left to the erase
+	for (addr = 0; addr < size; addr += NXP_COPY_SIZE) {
+		len = NXPDisplayCopySize(size - addr);
+		if (NXPDisplayBlockBlank(image + addr, len)) {
+			continue;
+		}
+		pBlock = &blocks[header.blockCount++];
+		pBlock->flashAddr = addr;
+		pBlock->size = len;
+		pBlock->dataOffset = dataSize;
+		pBlock->firstChunk = header.chunkCount;
+		dataSize += len;
+		chunkSize = len < NXP_RAM_WRITE_SIZE ? len : NXP_RAM_WRITE_SIZE;
+		for (j = 0; j < len; j += chunkSize) {
+			NXPDisplayEncodeBlock(image + addr + j, chunkSize, &block);
+			chunks[header.chunkCount].chksum = block.chksum;
+			if (encoded) {
+				chunks[header.chunkCount].textOffset = textSize;
+				for (k = 0; k < block.lineCount; k++) {
+					textSize += block.lineLen[k] + 1;
+				}
+				chunks[header.chunkCount].textLen = textSize
+						- chunks[header.chunkCount].textOffset;
+			}
+			header.chunkCount++;
+		}
+	}
+
+	header.blockOffset = sizeof(header);
+	header.chunkOffset = header.blockOffset
+			+ header.blockCount * sizeof(PlanBlock_t);
+	header.dataOffset = header.chunkOffset
+			+ header.chunkCount * sizeof(PlanChunk_t);
+	header.textOffset = encoded ? header.dataOffset + dataSize : 0;
+	header.fileSize = header.dataOffset + dataSize + textSize;
+	for (i = 0; i < header.blockCount; i++) {
+		blocks[i].dataOffset += header.dataOffset;
+	}
+	for (i = 0; encoded && i < header.chunkCount; i++) {
+		chunks[i].textOffset += header.textOffset;
+	}
+
+	f = fopen(argv[arg + 1], "wb");
+	if (f == NULL) {
+		printf("%s: %s\n", argv[arg + 1], strerror(errno));
+		return 2;
+	}
+	if (PlanPut(f, &header, sizeof(header)) != 0
+			|| PlanPut(f, blocks, header.blockCount * sizeof(PlanBlock_t))
+					!= 0
+			|| PlanPut(f, chunks, header.chunkCount * sizeof(PlanChunk_t))
+					!= 0) {
+		printf("%s: %s\n", argv[arg + 1], strerror(errno));
+		fclose(f);
+		return 2;
+	}
+	for (i = 0; i < header.blockCount; i++) {
+		if (PlanPut(f, image + blocks[i].flashAddr, blocks[i].size) != 0) {
+			printf("%s: %s\n", argv[arg + 1], strerror(errno));
+			fclose(f);
+			return 2;
+		}
+	}
+	// the same lines NXPDisplayWriteRAM sends, encoded once here
+	for (i = 0; encoded && i < header.blockCount; i++) {
+		pBlock = &blocks[i];
+		chunkSize = pBlock->size < NXP_RAM_WRITE_SIZE ?
+				pBlock->size : NXP_RAM_WRITE_SIZE;
+		for (j = 0; j < pBlock->size; j += chunkSize) {
+			NXPDisplayEncodeBlock(image + pBlock->flashAddr + j, chunkSize,
+					&block);
+			len = 0;
+			for (k = 0; k < block.lineCount; k++) {
+				memcpy(text + len, block.line[k], block.lineLen[k]);
+				len += block.lineLen[k];
+				text[len++] = '\r';
+			}
+			if (PlanPut(f, text, len) != 0) {
+				printf("%s: %s\n", argv[arg + 1], strerror(errno));
+				fclose(f);
+				return 2;
+			}
+		}
+	}
+	if (fclose(f) != 0) {
+		printf("%s: %s\n", argv[arg + 1], strerror(errno));
+		return 2;
+	}
+
+	printf("%u bytes, CRC %08X, %u of %u blocks, erase mask %08X, "
+			"%u byte plan\n", size, header.imageCrc, header.blockCount,
+			(size + NXP_COPY_SIZE - 1) / NXP_COPY_SIZE, header.eraseMask,
+			header.fileSize);
+	return 0;
+}
@@ -0,0 +1,1556 @@
+// Host simulator for NXPISP.c
+// Stands in for the bridge UART/CAN drivers and answers like an LPC1788 ISP
+// boot ROM with an in-memory flash and RAM, so a full reflash can run and be
+// timed on a plain Linux box:
+//
+//   gcc -O2 -o NXPISPSim NXPISPSim.c && ./NXPISPSim -s 65536
+//
+// Exits non zero when the flash does not hold the image afterwards. Build
+// with -DNXP_LOW_RAM_ENABLE=1 to run the low RAM bridge, the footprint line
+// shows what its buffers take in each build.
+//
+// With -y image.bin it instead serves the boot ROM on a pty, for NXPISPFlash
+// to talk to, and checks the flash against image.bin once the host has been
+// quiet for a second.
+
+
+//
+// INCLUDED FILES
+//
+// posix_openpt and friends
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "NXPISPHost.h"
+
+// the bridge sleeps until the next SCI byte or RTI tick
+void SimWait(void);
+#define NXP_UART_WAIT() SimWait()
+
+// and serves the rest of the CAN traffic before it does
+void SimIdle(void);
+#define NXP_IDLE_HOOK() SimIdle()
+
+#include "NXPISP.c"
+
+//
+// LOCAL DEFINITIONS, MACROS, AND TYPEDEFS
+//
+#define SIM_FLASH_SIZE (0x80000)
+#define SIM_RAM_ADDRESS (0x10000000)
+#define SIM_RAM_SIZE (0x10000)
+#define SIM_OUT_SIZE (8192)
+#define SIM_LINE_MAX (128)
+#define SIM_PART_ID ("0673005383")
+
+// compressor match search, candidates tried per position
+#define SIM_LZ_CHAIN (32)
+#define SIM_LZ_HASH_SIZE (4096)
+#define SIM_LZ_LENGTH_MAX (LZ_LENGTH_EXTEND + 255)
+
+// RTI tick waking the bridge while nothing arrives
+#define SIM_TICK_US (1000.0)
+
+// shorter RESET pulses are filtered out and the part carries on
+#define SIM_RESET_MIN_US (500.0)
+
+// Framing as the boot ROM's: echoes repeat the line with the CR it ended
+// with, everything else the target sends ends with CR LF
+#define SIM_ECHO_END ("\r")
+#define SIM_LINE_END ("\r\n")
+
+typedef enum {
+	SIM_RESET, SIM_SYNC, SIM_FREQ, SIM_CMD, SIM_W_DATA, SIM_R_ACK
+} SimState_t;
+
+// timing model, all in microseconds
+typedef struct {
+	double cmdLatency;
+	double eraseTime;
+	double programTime;
+	// from reset release until the boot ROM listens for ?
+	double bootTime;
+} SimTiming_t;
+
+// part of the image the host sends in one go
+typedef struct {
+	uint32_t start;
+	uint32_t end;
+} SimPiece_t;
+
+typedef struct {
+	uint64_t bytesToTarget;
+	uint64_t bytesFromTarget;
+	uint32_t commands;
+	uint32_t erases;
+	uint32_t copies;
+	uint32_t resends;
+} SimStats_t;
+
+//
+// STATIC VARIABLE DEFINITIONS
+//
+static uint8_t simFlash[SIM_FLASH_SIZE];
+static uint8_t simRam[SIM_RAM_SIZE];
+
+static uint8_t simOut[SIM_OUT_SIZE];
+// time each byte of simOut is ready to go out, the target sends nothing
+// while it is busy with a command
+static double simOutAt[SIM_OUT_SIZE];
+static double simBusyUntil = 0;
+static uint32_t simOutHead;
+static uint32_t simOutTail;
+
+static char simLine[SIM_LINE_MAX];
+static uint32_t simLineLen;
+
+static SimState_t simState = SIM_RESET;
+static uint8_t simEcho = 1;
+static uint8_t simUnlocked = 0;
+static int32_t simPreparedFirst = -1;
+static int32_t simPreparedLast = -1;
+static uint32_t simInReset = 0;
+static double simResetAt = 0;
+static double simBootDone = 0;
+
+// W in progress
+static uint32_t simWAddr;
+static uint32_t simWCount;
+static uint32_t simWDone;
+static uint32_t simWChksum;
+
+// R in progress, the group of lines awaiting OK starts at simRAddr
+static uint32_t simRAddr;
+static uint32_t simRCount;
+static uint32_t simRGroup;
+
+// flash as handleNXPDisplayRead handed it out, with -d
+static uint8_t simDump[SIM_FLASH_SIZE];
+static uint32_t simDumpBytes;
+
+static uint32_t simTargetBaud = NXP_BAUD_DEFAULT;
+static uint32_t simHostBaud = NXP_BAUD_DEFAULT;
+// fastest rate the cable carries
+static uint32_t simLinkBaud = 230400;
+
+// send the image with handleNXPDisplayWriteCompressed
+static uint32_t simCompress = 0;
+static uint32_t simCanBytes = 0;
+
+// the link drops once this many image bytes have been sent, 0 for never
+static uint32_t simDropAt = 0;
+static uint32_t simResumedAt = 0;
+// the image is rebuilt under the same id while the link is down
+static uint32_t simRebuild = 0;
+static uint32_t simStaleResumes = 0;
+
+// what the bridge should report at terminate
+static uint32_t simImageCrc;
+static uint32_t simImageSize;
+
+// the image as the host sends it, in this order. With -g a gap splits it in
+// two segments, the last bytes of the first one are sent after the second
+// one has started when both end up in the same block.
+static SimPiece_t simPieces[4];
+static uint32_t simPieceCount;
+
+// every Nth C command leaves a byte unprogrammed, once per 256 bytes of
+// flash at most, 0 for never
+static uint32_t simWeakEvery = 0;
+static uint8_t simWeakDone[SIM_FLASH_SIZE / 256];
+
+// every Nth checksum is reported wrong once, 0 for never
+static uint32_t simCorruptEvery = 0;
+static uint32_t simChecksums = 0;
+
+static SimTiming_t simTiming = { 200.0, 100000.0, 1000.0, 5000.0 };
+static SimStats_t simStats;
+static double simTimeUs = 0;
+
+// receive the bridge has armed with sciReceive
+static uint8_t *simRxDest;
+
+// NXP_IDLE_HOOK calls, and NXP requests sent in from it that the bridge
+// took on instead of refusing
+static uint32_t simIdleCalls;
+static uint32_t simNestedTaken;
+
+int canREG2Port;
+sciBASE_t sciLinPort;
+
+//
+// START OF OPERATIONAL CODE
+//
+
+/*
+ *  PARAMETERS: bytes
+ *
+ *  DESCRIPTION: time on the wire at the current rate, 10 bits a byte
+ *
+ *  RETURNS: microseconds
+ *
+ */
+static double SimWireTime(uint32_t bytes) {
+	return bytes * 10.0 * 1000000.0 / simTargetBaud;
+}
+
+/*
+ *  PARAMETERS: s
+ *
+ *  DESCRIPTION: queue target output for the host
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimReply(const char *s) {
+	// a host at the wrong rate or a link too slow for it only sees noise
+	if (simHostBaud != simTargetBaud || simTargetBaud > simLinkBaud) {
+		return;
+	}
+	while (*s) {
+		simOutAt[simOutHead] =
+				simBusyUntil > simTimeUs ? simBusyUntil : simTimeUs;
+		simOut[simOutHead] = *s++;
+		simOutHead = (simOutHead + 1) % SIM_OUT_SIZE;
+	}
+}
+
+/*
+ *  PARAMETERS: us
+ *
+ *  DESCRIPTION: the target works that long before it sends anything more
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimBusy(double us) {
+	if (simBusyUntil < simTimeUs) {
+		simBusyUntil = simTimeUs;
+	}
+	simBusyUntil += us;
+}
+
+/*
+ *  PARAMETERS: code ISP return code
+ *
+ *  DESCRIPTION: queue a return code
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimReplyCode(uint32_t code) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%u%s", code, SIM_LINE_END);
+	SimReply(buf);
+}
+
+/*
+ *  PARAMETERS: s
+ *
+ *  DESCRIPTION: queue a line of target output
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimReplyLine(const char *s) {
+	SimReply(s);
+	SimReply(SIM_LINE_END);
+}
+
+/*
+ *  PARAMETERS: line line from the host without CR
+ *
+ *  DESCRIPTION: queue the echo of a line
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimEcho(const char *line) {
+	SimReply(line);
+	SimReply(SIM_ECHO_END);
+}
+
+/*
+ *  PARAMETERS: addr, n
+ *
+ *  DESCRIPTION: map a target address range to the flash or RAM model
+ *
+ *  RETURNS: pointer, NULL when not mapped
+ *
+ */
+static uint8_t *SimMap(uint32_t addr, uint32_t n) {
+	if (addr + n <= SIM_FLASH_SIZE) {
+		return simFlash + addr;
+	}
+	if (addr >= SIM_RAM_ADDRESS && addr + n <= SIM_RAM_ADDRESS + SIM_RAM_SIZE) {
+		return simRam + addr - SIM_RAM_ADDRESS;
+	}
+	return NULL;
+}
+
+/*
+ *  PARAMETERS: c uuencode char
+ *
+ *  DESCRIPTION: uudecode one char
+ *
+ *  RETURNS: 6 bits
+ *
+ */
+static uint32_t SimUUDecodeChar(char c) {
+	return (c - UUENCODE_OFFSET) & 0x3F;
+}
+
+/*
+ *  PARAMETERS: line uuencoded data line
+ *
+ *  DESCRIPTION: decode a W data line into RAM
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimWData(const char *line) {
+	uint32_t num = SimUUDecodeChar(line[0]);
+	uint32_t i;
+	uint32_t word = 0;
+	uint8_t b;
+	const char *p = line + 1;
+	uint8_t *dest = SimMap(simWAddr, simWCount);
+
+	for (i = 0; i < num; i++) {
+		if (i % 3 == 0) {
+			word = (SimUUDecodeChar(p[0]) << 18) | (SimUUDecodeChar(p[1]) << 12)
+					| (SimUUDecodeChar(p[2]) << 6) | SimUUDecodeChar(p[3]);
+			p += 4;
+		}
+		b = (word >> (16 - 8 * (i % 3))) & 0xFF;
+		if (simWDone < simWCount) {
+			dest[simWDone++] = b;
+			simWChksum += b;
+		}
+	}
+}
+
+/*
+ *  PARAMETERS: sector
+ *
+ *  DESCRIPTION: prepared check for E and C
+ *
+ *  RETURNS: 1 when prepared
+ *
+ */
+static uint32_t SimPrepared(uint32_t sector) {
+	return simPreparedFirst >= 0 && (int32_t) sector >= simPreparedFirst
+			&& (int32_t) sector <= simPreparedLast;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: send the next group of R lines from simRAddr, 20 lines or
+ *  			what is left, then its checksum
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimRData() {
+	uint8_t line[UUENCODE_LINE_MAX + 1];
+	const uint8_t *data = SimMap(simRAddr, simRCount);
+	uint32_t chksum = 0;
+	char buf[16];
+	uint32_t num;
+
+	simRGroup = simRCount;
+	if (simRGroup > ISP_READ_LINES * UUENCODE_MAX_BYTES) {
+		simRGroup = ISP_READ_LINES * UUENCODE_MAX_BYTES;
+	}
+	for (num = 0; num < simRGroup; num += UUENCODE_MAX_BYTES) {
+		NXPDisplayEncodeLine(data + num,
+				simRGroup - num < UUENCODE_MAX_BYTES ?
+						simRGroup - num : UUENCODE_MAX_BYTES, line, &chksum);
+		SimReplyLine((char *) line);
+	}
+	simChecksums++;
+	if (simCorruptEvery != 0 && (simChecksums % simCorruptEvery) == 0) {
+		chksum = ~chksum;
+	}
+	snprintf(buf, sizeof(buf), "%u", chksum);
+	SimReplyLine(buf);
+}
+
+/*
+ *  PARAMETERS: line command line without CR
+ *
+ *  DESCRIPTION: run one ISP command
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimCommand(const char *line) {
+	uint32_t a = 0;
+	uint32_t b = 0;
+	uint32_t c = 0;
+	uint32_t i;
+	uint8_t *src;
+	uint8_t *dst;
+	char buf[32];
+	int n = sscanf(line + 1, "%u %u %u", &a, &b, &c);
+
+	simStats.commands++;
+	// the boot ROM echoes as the line comes in, the return code takes longer
+	if (simEcho) {
+		SimEcho(line);
+	}
+	SimBusy(simTiming.cmdLatency);
+
+	switch (line[0]) {
+	case 'J':
+		SimReplyCode(ISP_CMD_SUCCESS);
+		SimReplyLine(SIM_PART_ID);
+		break;
+	case 'U':
+		if (n != 1 || a != 23130) {
+			SimReplyCode(ISP_PARAM_ERROR);
+			break;
+		}
+		simUnlocked = 1;
+		SimReplyCode(ISP_CMD_SUCCESS);
+		break;
+	case 'A':
+		SimReplyCode(ISP_CMD_SUCCESS);
+		simEcho = (a != 0);
+		break;
+	case 'B':
+		if (n != 2 || a == 0) {
+			SimReplyCode(ISP_INVALID_BAUD_RATE);
+			break;
+		}
+		SimReplyCode(ISP_CMD_SUCCESS);
+		simTargetBaud = a;
+		break;
+	case 'P':
+		if (n != 2 || a > b || b > MAX_SECTOR) {
+			SimReplyCode(ISP_INVALID_SECTOR);
+			break;
+		}
+		simPreparedFirst = a;
+		simPreparedLast = b;
+		SimReplyCode(ISP_CMD_SUCCESS);
+		break;
+	case 'E':
+		if (n != 2 || a > b || b > MAX_SECTOR) {
+			SimReplyCode(ISP_INVALID_SECTOR);
+			break;
+		}
+		if (!simUnlocked) {
+			SimReplyCode(ISP_CMD_LOCKED);
+			break;
+		}
+		for (i = a; i <= b; i++) {
+			if (!SimPrepared(i)) {
+				break;
+			}
+		}
+		if (i <= b) {
+			SimReplyCode(ISP_SECTOR_NOT_PREPARED);
+			break;
+		}
+		for (i = a; i <= b; i++) {
+			memset(simFlash + sectorGeometry[i].start, 0xFF,
+					sectorGeometry[i].size);
+			SimBusy(simTiming.eraseTime);
+			simStats.erases++;
+		}
+		simPreparedFirst = simPreparedLast = -1;
+		SimReplyCode(ISP_CMD_SUCCESS);
+		break;
+	case 'W':
+		if (n != 2 || (b % 4) != 0 || a < SIM_RAM_ADDRESS
+				|| SimMap(a, b) == NULL) {
+			SimReplyCode(ISP_ADDR_ERROR);
+			break;
+		}
+		SimReplyCode(ISP_CMD_SUCCESS);
+		simWAddr = a;
+		simWCount = b;
+		simWDone = 0;
+		simWChksum = 0;
+		simState = SIM_W_DATA;
+		break;
+	case 'C':
+		if (n != 3 || (a % 256) != 0 || a + c > SIM_FLASH_SIZE
+				|| b < SIM_RAM_ADDRESS || SimMap(b, c) == NULL) {
+			SimReplyCode(ISP_ADDR_ERROR);
+			break;
+		}
+		if (c != 256 && c != 512 && c != 1024 && c != 4096) {
+			SimReplyCode(ISP_COUNT_ERROR);
+			break;
+		}
+		if (!simUnlocked) {
+			SimReplyCode(ISP_CMD_LOCKED);
+			break;
+		}
+		if (!SimPrepared(NXPFlashSector(a))
+				|| !SimPrepared(NXPFlashSector(a + c - 1))) {
+			SimReplyCode(ISP_SECTOR_NOT_PREPARED);
+			break;
+		}
+		// NOR flash, programming can only clear bits
+		src = SimMap(b, c);
+		for (i = 0; i < c; i++) {
+			simFlash[a + i] &= src[i];
+		}
+		SimBusy(simTiming.programTime * (c / 256));
+		simStats.copies++;
+		if (simWeakEvery != 0 && (simStats.copies % simWeakEvery) == 0
+				&& !simWeakDone[(a + c - 1) / 256]) {
+			simWeakDone[(a + c - 1) / 256] = 1;
+			simFlash[a + c - 1] |= ~src[c - 1];
+		}
+		simPreparedFirst = simPreparedLast = -1;
+		SimReplyCode(ISP_CMD_SUCCESS);
+		break;
+	case 'M':
+		src = SimMap(a, c);
+		dst = SimMap(b, c);
+		if (n != 3 || src == NULL || dst == NULL || (c % 4) != 0) {
+			SimReplyCode(ISP_ADDR_ERROR);
+			break;
+		}
+		for (i = 0; i < c && src[i] == dst[i]; i++) {
+		}
+		if (i == c) {
+			SimReplyCode(ISP_CMD_SUCCESS);
+			break;
+		}
+		SimReplyCode(ISP_COMPARE_ERROR);
+		snprintf(buf, sizeof(buf), "%u", i & ~3);
+		SimReplyLine(buf);
+		break;
+	case 'R':
+		if (n != 2 || (b % 4) != 0 || SimMap(a, b) == NULL) {
+			SimReplyCode(ISP_ADDR_ERROR);
+			break;
+		}
+		SimReplyCode(ISP_CMD_SUCCESS);
+		simRAddr = a;
+		simRCount = b;
+		SimRData();
+		simState = SIM_R_ACK;
+		break;
+	default:
+		SimReplyCode(ISP_INVALID_COMMAND);
+		break;
+	}
+}
+
+/*
+ *  PARAMETERS: line complete line from the host without CR
+ *
+ *  DESCRIPTION: handle a line in the current state
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimLineDone(const char *line) {
+	uint32_t chksum;
+
+	switch (simState) {
+	case SIM_SYNC:
+		if (strcmp(line, HANDSHAKING_SYN_MSG) == 0) {
+			SimEcho(line);
+			SimReplyLine(RESPONSE_OK);
+			simState = SIM_FREQ;
+		}
+		break;
+	case SIM_FREQ:
+		SimEcho(line);
+		SimReplyLine(RESPONSE_OK);
+		simState = SIM_CMD;
+		break;
+	case SIM_CMD:
+		SimCommand(line);
+		break;
+	case SIM_W_DATA:
+		if (simWDone < simWCount) {
+			if (simEcho) {
+				SimEcho(line);
+			}
+			SimWData(line);
+			break;
+		}
+		// checksum line
+		if (simEcho) {
+			SimEcho(line);
+		}
+		chksum = strtoul(line, NULL, 10);
+		simChecksums++;
+		if (simCorruptEvery != 0 && (simChecksums % simCorruptEvery) == 0) {
+			chksum = ~chksum;
+		}
+		if (chksum != simWChksum) {
+			simStats.resends++;
+			simWDone = 0;
+			simWChksum = 0;
+			SimReplyLine(RESPONSE_RESEND);
+			break;
+		}
+		SimReplyLine(RESPONSE_OK);
+		simState = SIM_CMD;
+		break;
+	case SIM_R_ACK:
+		if (simEcho) {
+			SimEcho(line);
+		}
+		if (strcmp(line, RESPONSE_RESEND) == 0) {
+			simStats.resends++;
+			SimRData();
+			break;
+		}
+		simRAddr += simRGroup;
+		simRCount -= simRGroup;
+		if (simRCount != 0) {
+			SimRData();
+			break;
+		}
+		simState = SIM_CMD;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ *  PARAMETERS: c byte from the host
+ *
+ *  DESCRIPTION: feed the ISP responder
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimByte(uint8_t c) {
+	if (simState == SIM_RESET) {
+		if (c == '?' && simTimeUs >= simBootDone) {
+			SimReplyLine(RESPONSE_SYN);
+			simState = SIM_SYNC;
+		}
+		return;
+	}
+	if (c == '\n') {
+		return;
+	}
+	if (c == '\r') {
+		simLine[simLineLen] = 0;
+		simLineLen = 0;
+		SimLineDone(simLine);
+		return;
+	}
+	if (simLineLen < SIM_LINE_MAX - 1) {
+		simLine[simLineLen++] = c;
+	}
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP boot ROM fresh from reset
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimReset() {
+	simState = SIM_RESET;
+	simEcho = 1;
+	simUnlocked = 0;
+	simPreparedFirst = simPreparedLast = -1;
+	simTargetBaud = NXP_BAUD_DEFAULT;
+	simLineLen = 0;
+	simOutHead = simOutTail = 0;
+	simBusyUntil = 0;
+	simBootDone = simTimeUs + simTiming.bootTime;
+}
+
+void canIoSetPort(int *port, uint32_t bit, uint32_t value) {
+	(void) port;
+	(void) bit;
+	if (value == 0) {
+		if (!simInReset) {
+			simResetAt = simTimeUs;
+		}
+		simInReset = 1;
+	} else if (simInReset) {
+		simInReset = 0;
+		if (simTimeUs - simResetAt >= SIM_RESET_MIN_US) {
+			SimReset();
+		}
+	}
+}
+
+void canDumpOutput(uint32_t addr, const uint8_t *data, uint32_t len) {
+	memcpy(simDump + addr, data, len);
+	simDumpBytes += len;
+}
+
+void sciSend(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	uint32_t i;
+	simTimeUs += SimWireTime(length);
+	simStats.bytesToTarget += length;
+	if (!simInReset && simHostBaud == simTargetBaud
+			&& simTargetBaud <= simLinkBaud) {
+		for (i = 0; i < length; i++) {
+			SimByte(data[i]);
+		}
+	}
+	NXPUartNotification(sci, SCI_TX_INT);
+}
+
+void sciReceive(sciBASE_t *sci, uint32_t length, uint8_t *data) {
+	(void) sci;
+	(void) length;
+	simRxDest = data;
+}
+
+void sciSetBaudrate(sciBASE_t *sci, uint32_t baud) {
+	(void) sci;
+	simHostBaud = baud;
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP_UART_WAIT, deliver the target output up to the end of a
+ *  			line through the SCI receive interrupt, or sleep until it is
+ *  			ready or one RTI tick has passed. A line at a time, the bridge
+ *  			takes each one out of the RX ring while the next is on the
+ *  			wire.
+ *
+ *  RETURNS: void
+ *
+ */
+void SimWait(void) {
+	uint8_t *dest;
+	uint8_t c = 0;
+
+	if (simOutTail == simOutHead || simRxDest == NULL) {
+		simTimeUs += SIM_TICK_US;
+		return;
+	}
+	if (simOutAt[simOutTail] > simTimeUs) {
+		simTimeUs = simOutAt[simOutTail] < simTimeUs + SIM_TICK_US ?
+				simOutAt[simOutTail] : simTimeUs + SIM_TICK_US;
+		return;
+	}
+	while (simOutTail != simOutHead && simRxDest != NULL && c != '\n'
+			&& simOutAt[simOutTail] <= simTimeUs) {
+		dest = simRxDest;
+		simRxDest = NULL;
+		c = simOut[simOutTail];
+		*dest = c;
+		simOutTail = (simOutTail + 1) % SIM_OUT_SIZE;
+		simTimeUs += SimWireTime(1);
+		simStats.bytesFromTarget++;
+		NXPUartNotification(scilinREG, SCI_RX_INT);
+	}
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP_IDLE_HOOK, every so often a CAN host asks for a stats
+ *  			record and tries to start another image while the bridge is
+ *  			busy with the NXP. The prepare must be refused.
+ *
+ *  RETURNS: void
+ *
+ */
+void SimIdle(void) {
+	uint8_t cmd[2] = { STATS_RECORD_EVENTS, 0 };
+	RspFmt_Obj rsp;
+
+	if (simIdleCalls++ % 1000 != 0) {
+		return;
+	}
+	handleNXPDisplayStats(cmd, &rsp);
+	rsp.status = CMD_VALID;
+	handleNXPDisplayPrepare(&rsp);
+	if (rsp.status != CMD_POB_REJ) {
+		simNestedTaken++;
+	}
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: NXP_CYCLE_COUNT on the host, one cycle per simulated us
+ *
+ *  RETURNS: simulated time in us
+ *
+ */
+uint32_t NXPHostCycles(void) {
+	return (uint32_t) simTimeUs;
+}
+
+/*
+ *  PARAMETERS: crc running value, 0xFFFFFFFF to start
+ *  			data, size
+ *
+ *  DESCRIPTION: CRC-32 bit by bit, independent of the bridge's table
+ *
+ *  RETURNS: crc, invert it once at the end
+ *
+ */
+static uint32_t SimCrc32(uint32_t crc, const uint8_t *data, uint32_t size) {
+	uint32_t i;
+	int bit;
+	for (i = 0; i < size; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+		}
+	}
+	return crc;
+}
+
+/*
+ *  PARAMETERS: pRsp, index
+ *
+ *  DESCRIPTION: a word put with NXPDisplayRspPutWord
+ *
+ *  RETURNS: word
+ *
+ */
+static uint32_t SimRspWord(const RspFmt_Obj *pRsp, uint32_t index) {
+	return ((uint32_t) pRsp->data[index] << 24)
+			| ((uint32_t) pRsp->data[index + 1] << 16)
+			| ((uint32_t) pRsp->data[index + 2] << 8) | pRsp->data[index + 3];
+}
+
+/*
+ *  PARAMETERS: None
+ *
+ *  DESCRIPTION: print the bridge's own instrumentation, read back through
+ *  			handleNXPDisplayStats the way the CAN host does
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimPrintStats() {
+	static const char *phases[PHASE_COUNT] = { "handshake", "erase",
+			"RAM write", "compare", "copy", "read" };
+	uint8_t cmd[2] = { 0, 0 };
+	RspFmt_Obj rsp;
+	uint32_t w[8];
+	uint32_t i;
+	uint32_t j;
+
+	printf("\ncmd  count errors   bytes out  bytes in   min us   avg us   max us\n");
+	for (i = 0; i <= STATS_RECORD_DEADLINE; i++) {
+		memset(&rsp, 0, sizeof(rsp));
+		cmd[0] = i;
+		handleNXPDisplayStats(cmd, &rsp);
+		for (j = 0; j < 8; j++) {
+			w[j] = SimRspWord(&rsp, 4 * j);
+		}
+		if (i < STATS_RECORD_PHASE) {
+			if (w[0] != 0) {
+				printf("%-4s %5u %6u %11u %9u %8u %8u %8u\n",
+						ispCmdTable[i].text, w[0], w[1], w[2], w[3], w[4], w[5],
+						w[6]);
+			}
+		} else if (i < STATS_RECORD_EVENTS) {
+			printf("%-10s %10.3f s in %u\n", phases[i - STATS_RECORD_PHASE],
+					(((uint64_t) w[0] << 32) | w[1]) / 1000000.0, w[2]);
+		} else if (i == STATS_RECORD_EVENTS) {
+			printf("resends %u, resyncs %u, blank blocks %u, matched blocks %u,"
+					" timeouts %u, recommits %u,\nsync retries %u, warm sessions"
+					" %u\n", w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7]);
+		} else if (i == STATS_RECORD_FOOTPRINT) {
+			printf("footprint  %u bytes buffers, %u bytes stack%s\n", w[0], w[1],
+					w[2] ? ", low RAM" : "");
+		} else {
+			printf("deadlines  us + 4 x deviation: echo %u+4x%u, erase/sector"
+					" %u+4x%u,\n           copy/256 %u+4x%u, compare/256"
+					" %u+4x%u\n", w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7]);
+		}
+	}
+}
+
+/*
+ *  PARAMETERS: out compressed stream dest, at least size * 129 / 128 + 1
+ *  			pLen bytes in out
+ *  			c literal
+ *  			pLiterals start of the pending literal run in out, 0 for none
+ *
+ *  DESCRIPTION: append a literal, opening a new run when needed
+ *
+ *  RETURNS: void
+ *
+ */
+static void SimLzLiteral(uint8_t *out, uint32_t *pLen, uint8_t c,
+		uint32_t *pLiterals) {
+	if (*pLiterals == 0 || out[*pLiterals - 1] == LZ_LITERAL_MAX - 1) {
+		out[(*pLen)++] = 0;
+		*pLiterals = *pLen;
+	} else {
+		out[*pLiterals - 1]++;
+	}
+	out[(*pLen)++] = c;
+}
+
+/*
+ *  PARAMETERS: in, size image
+ *  			out compressed stream dest
+ *
+ *  DESCRIPTION: the compressed write format, greedy with a hash chain over
+ *  			the decoder window
+ *
+ *  RETURNS: compressed bytes
+ *
+ */
+static uint32_t SimLzCompress(const uint8_t *in, uint32_t size, uint8_t *out) {
+	static int32_t head[SIM_LZ_HASH_SIZE];
+	static int32_t prev[SIM_FLASH_SIZE];
+	uint32_t len = 0;
+	uint32_t literals = 0;
+	uint32_t pos = 0;
+	uint32_t best;
+	uint32_t bestDist = 0;
+	uint32_t hash;
+	uint32_t n;
+	uint32_t k;
+	int32_t cand;
+	int chain;
+
+	memset(head, 0xFF, sizeof(head));
+	while (pos < size) {
+		best = 0;
+		if (pos + LZ_MATCH_MIN <= size) {
+			hash = ((in[pos] << 8) ^ (in[pos + 1] << 4) ^ in[pos + 2])
+					& (SIM_LZ_HASH_SIZE - 1);
+			cand = head[hash];
+			for (chain = 0; chain < SIM_LZ_CHAIN && cand >= 0
+					&& pos - cand <= LZ_WINDOW_SIZE; chain++) {
+				for (n = 0; pos + n < size && n < SIM_LZ_LENGTH_MAX
+						&& in[cand + n] == in[pos + n]; n++) {
+				}
+				if (n > best) {
+					best = n;
+					bestDist = pos - cand;
+				}
+				cand = prev[cand];
+			}
+			prev[pos] = head[hash];
+			head[hash] = pos;
+		}
+		if (best < LZ_MATCH_MIN) {
+			SimLzLiteral(out, &len, in[pos++], &literals);
+			continue;
+		}
+
+		literals = 0;
+		n = best < LZ_LENGTH_EXTEND ? best : LZ_LENGTH_EXTEND;
+		out[len++] = LZ_LITERAL_MAX | ((n - LZ_MATCH_MIN) << 2)
+				| ((bestDist - 1) >> 8);
+		out[len++] = (bestDist - 1) & 0xFF;
+		if (n == LZ_LENGTH_EXTEND) {
+			out[len++] = best - LZ_LENGTH_EXTEND;
+		}
+		// keep the chains going through the match
+		for (k = pos + 1; k < pos + best && k + LZ_MATCH_MIN <= size; k++) {
+			hash = ((in[k] << 8) ^ (in[k + 1] << 4) ^ in[k + 2])
+					& (SIM_LZ_HASH_SIZE - 1);
+			prev[k] = head[hash];
+			head[hash] = k;
+		}
+		pos += best;
+	}
+	return len;
+}
+
+/*
+ *  PARAMETERS: image, from, to image bytes to send
+ *  			chunk bytes per write command
+ *
+ *  DESCRIPTION: write part of the image like the CAN host does, compressed
+ *  			as a stream of its own with -z
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+static uint32_t SimSend(const uint8_t *image, uint32_t from, uint32_t to,
+		uint32_t chunk) {
+	static uint8_t cmd[DATA_INDEX + SIM_FLASH_SIZE];
+	static uint8_t packed[SIM_FLASH_SIZE + SIM_FLASH_SIZE / 64 + 4];
+	RspFmt_Obj rsp;
+	const uint8_t *src = image + from;
+	uint32_t size = to - from;
+	uint32_t done;
+	uint32_t n;
+
+	if (simCompress) {
+		size = SimLzCompress(src, size, packed);
+		src = packed;
+	}
+	simCanBytes += size;
+
+	memset(&rsp, 0, sizeof(rsp));
+	for (done = 0; done < size; done += n) {
+		n = size - done;
+		if (n > chunk) {
+			n = chunk;
+		}
+		// a compressed stream carries on where it is, the address is unused
+		cmd[START_ADDR_INDEX] = ((from + done) >> 24) & 0xFF;
+		cmd[START_ADDR_INDEX + 1] = ((from + done) >> 16) & 0xFF;
+		cmd[START_ADDR_INDEX + 2] = ((from + done) >> 8) & 0xFF;
+		cmd[START_ADDR_INDEX + 3] = (from + done) & 0xFF;
+		cmd[SIZE_BYTES_INDEX] = (n >> 24) & 0xFF;
+		cmd[SIZE_BYTES_INDEX + 1] = (n >> 16) & 0xFF;
+		cmd[SIZE_BYTES_INDEX + 2] = (n >> 8) & 0xFF;
+		cmd[SIZE_BYTES_INDEX + 3] = n & 0xFF;
+		// the bridge swaps every word back, on a little endian host that
+		// leaves the bytes as they are
+		memcpy(cmd + DATA_INDEX, src + done, n);
+		rsp.status = CMD_POB_REJ;
+		if (simCompress) {
+			handleNXPDisplayWriteCompressed(cmd, &rsp);
+		} else {
+			handleNXPDisplayWrite(cmd, &rsp);
+		}
+		if (rsp.status != CMD_VALID) {
+			printf("write failed at %u\n", from + done);
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: image, from, to image addresses to send
+ *  			chunk bytes per write command
+ *
+ *  DESCRIPTION: send what of every piece lies in [from, to), in piece order
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+static uint32_t SimSendPieces(const uint8_t *image, uint32_t from, uint32_t to,
+		uint32_t chunk) {
+	uint32_t start;
+	uint32_t end;
+	uint32_t i;
+
+	for (i = 0; i < simPieceCount; i++) {
+		start = simPieces[i].start > from ? simPieces[i].start : from;
+		end = simPieces[i].end < to ? simPieces[i].end : to;
+		if (start < end && SimSend(image, start, end, chunk) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: image
+ *  			to image address to stop at
+ *  			pBytes set to the number of bytes summed
+ *
+ *  DESCRIPTION: CRC-32 of the image as the pieces send it, below to
+ *
+ *  RETURNS: crc
+ *
+ */
+static uint32_t SimPrefixCrc(const uint8_t *image, uint32_t to,
+		uint32_t *pBytes) {
+	uint32_t crc = 0xFFFFFFFF;
+	uint32_t end;
+	uint32_t i;
+
+	*pBytes = 0;
+	for (i = 0; i < simPieceCount; i++) {
+		end = simPieces[i].end < to ? simPieces[i].end : to;
+		if (simPieces[i].start < end) {
+			crc = SimCrc32(crc, image + simPieces[i].start,
+					end - simPieces[i].start);
+			*pBytes += end - simPieces[i].start;
+		}
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+/*
+ *  PARAMETERS: imageId
+ *  			image the host is sending
+ *  			pFrom set to the image address to carry on from
+ *
+ *  DESCRIPTION: the CAN host starting or resuming a download. The CRC and
+ *  			size the bridge took in below the resume address must match
+ *  			the image, otherwise it starts over with image id 0.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+static uint32_t SimResume(uint32_t imageId, const uint8_t *image,
+		uint32_t *pFrom) {
+	uint32_t bytes;
+	uint8_t cmd[4];
+	RspFmt_Obj rsp;
+
+	cmd[RESUME_ID_INDEX] = (imageId >> 24) & 0xFF;
+	cmd[RESUME_ID_INDEX + 1] = (imageId >> 16) & 0xFF;
+	cmd[RESUME_ID_INDEX + 2] = (imageId >> 8) & 0xFF;
+	cmd[RESUME_ID_INDEX + 3] = imageId & 0xFF;
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayResume(cmd, &rsp);
+	if (rsp.status != CMD_VALID) {
+		printf("resume failed\n");
+		return CMD_POB_REJ;
+	}
+	*pFrom = SimRspWord(&rsp, RSP_RESUME_ADDR_INDEX);
+	if (SimPrefixCrc(image, *pFrom, &bytes)
+			!= SimRspWord(&rsp, RSP_RESUME_CRC_INDEX)
+			|| bytes != SimRspWord(&rsp, RSP_RESUME_BYTES_INDEX)) {
+		if (imageId == 0) {
+			printf("bridge took in data before a fresh start\n");
+			return CMD_POB_REJ;
+		}
+		simStaleResumes++;
+		return SimResume(0, image, pFrom);
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: image, size
+ *  			chunk bytes per write command
+ *
+ *  DESCRIPTION: run prepare, write and terminate like the CAN host does.
+ *  			With -k the link drops after that many bytes, the NXP is
+ *  			reset and the download resumed. With -n as well the image
+ *  			changes while the link is down, under the same id.
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+static uint32_t SimFlashImage(uint8_t *image, uint32_t size,
+		uint32_t chunk) {
+	uint8_t cmd[DATA_INDEX + 4];
+	RspFmt_Obj rsp;
+	uint32_t imageId;
+	uint32_t from = 0;
+
+	simImageCrc = SimPrefixCrc(image, size, &simImageSize);
+	imageId = simImageCrc | 1;
+
+	memset(&rsp, 0, sizeof(rsp));
+	if (simDropAt == 0 || simDropAt >= size) {
+		rsp.status = CMD_POB_REJ;
+		handleNXPDisplayPrepare(&rsp);
+		if (rsp.status != CMD_VALID) {
+			printf("prepare failed\n");
+			return CMD_POB_REJ;
+		}
+	} else {
+		if (SimResume(imageId, image, &from) != CMD_VALID
+				|| SimSendPieces(image, from, simDropAt, chunk) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+		canIoSetPort(canREG2, 1, 0);
+		if (simRebuild) {
+			// well inside what has been committed
+			image[simDropAt / 4] ^= 0x5A;
+			simImageCrc = SimPrefixCrc(image, size, &simImageSize);
+		}
+		if (SimResume(imageId, image, &from) != CMD_VALID) {
+			return CMD_POB_REJ;
+		}
+		simResumedAt = from;
+	}
+	if (SimSendPieces(image, from, size, chunk) != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
+	// a word for a block already committed is refused and leaves the image
+	// as it was
+	if (size > BUFFER_SIZE) {
+		memset(cmd, 0, sizeof(cmd));
+		cmd[SIZE_BYTES_INDEX + 3] = 4;
+		rsp.status = CMD_VALID;
+		handleNXPDisplayWrite(cmd, &rsp);
+		if (rsp.status != CMD_POB_REJ) {
+			printf("write below the current block taken\n");
+			return CMD_POB_REJ;
+		}
+	}
+	// and a read would reconnect under the download
+	memset(cmd, 0, sizeof(cmd));
+	cmd[SIZE_BYTES_INDEX + 3] = 4;
+	rsp.status = CMD_VALID;
+	handleNXPDisplayRead(cmd, &rsp);
+	if (rsp.status != CMD_POB_REJ) {
+		printf("read before terminate taken\n");
+		return CMD_POB_REJ;
+	}
+
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayTerminate(&rsp);
+	if (rsp.status != CMD_VALID) {
+		printf("terminate failed\n");
+		return CMD_POB_REJ;
+	}
+	if (SimRspWord(&rsp, RSP_CRC_INDEX) != simImageCrc
+			|| SimRspWord(&rsp, RSP_IMAGE_SIZE_INDEX) != simImageSize) {
+		printf("bridge CRC %08X over %u bytes, image %08X over %u bytes\n",
+				SimRspWord(&rsp, RSP_CRC_INDEX),
+				SimRspWord(&rsp, RSP_IMAGE_SIZE_INDEX), simImageCrc,
+				simImageSize);
+		return CMD_POB_REJ;
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: size bytes from address 0
+ *
+ *  DESCRIPTION: dump the flash with handleNXPDisplayRead like the CAN host
+ *  			does and check what came out and the CRC against the flash
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+static uint32_t SimDump(uint32_t size) {
+	uint8_t cmd[8];
+	RspFmt_Obj rsp;
+	uint32_t i;
+
+	cmd[START_ADDR_INDEX] = cmd[START_ADDR_INDEX + 1] = 0;
+	cmd[START_ADDR_INDEX + 2] = cmd[START_ADDR_INDEX + 3] = 0;
+	cmd[SIZE_BYTES_INDEX] = (size >> 24) & 0xFF;
+	cmd[SIZE_BYTES_INDEX + 1] = (size >> 16) & 0xFF;
+	cmd[SIZE_BYTES_INDEX + 2] = (size >> 8) & 0xFF;
+	cmd[SIZE_BYTES_INDEX + 3] = size & 0xFF;
+	memset(simDump, 0, sizeof(simDump));
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayRead(cmd, &rsp);
+	if (rsp.status != CMD_VALID) {
+		printf("dump failed\n");
+		return CMD_POB_REJ;
+	}
+	if (memcmp(simDump, simFlash, size) != 0) {
+		for (i = 0; i < size && simDump[i] == simFlash[i]; i++) {
+		}
+		printf("dump differs from flash at %u\n", i);
+		return CMD_POB_REJ;
+	}
+	if (SimRspWord(&rsp, RSP_CRC_INDEX)
+			!= (SimCrc32(0xFFFFFFFF, simFlash, size) ^ 0xFFFFFFFF)
+			|| SimRspWord(&rsp, RSP_READ_SIZE_INDEX) != size) {
+		printf("dump CRC %08X over %u bytes does not match the flash\n",
+				SimRspWord(&rsp, RSP_CRC_INDEX),
+				SimRspWord(&rsp, RSP_READ_SIZE_INDEX));
+		return CMD_POB_REJ;
+	}
+	return CMD_VALID;
+}
+
+/*
+ *  PARAMETERS: chunk bytes per write command
+ *
+ *  DESCRIPTION: start a compressed download that decodes to all of flash and
+ *  			a block more, the bridge must refuse the block past the end
+ *  			and then take a dump
+ *
+ *  RETURNS: Cmd Status
+ *
+ */
+static uint32_t SimLzOverrun(uint32_t chunk) {
+	static uint8_t zeros[SIM_FLASH_SIZE];
+	RspFmt_Obj rsp;
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.status = CMD_POB_REJ;
+	handleNXPDisplayPrepare(&rsp);
+	if (rsp.status != CMD_VALID) {
+		printf("prepare failed\n");
+		return CMD_POB_REJ;
+	}
+	simCompress = 1;
+	if (SimSend(zeros, 0, SIM_FLASH_SIZE, chunk) != CMD_VALID) {
+		return CMD_POB_REJ;
+	}
+	if (SimSend(zeros, 0, 2 * BUFFER_SIZE, chunk) == CMD_VALID) {
+		printf("stream past the end of flash taken\n");
+		return CMD_POB_REJ;
+	}
+	printf("stream past the end of flash refused\n");
+	// the download is over, so the flash can be read back again
+	return SimDump(SIM_FLASH_SIZE);
+}
+
+/*
+ *  PARAMETERS: path image the host is expected to flash
+ *
+ *  DESCRIPTION: answer on a pty instead of through the SCI stand-ins.
+ *  			Prints the pty name, serves until the host has been quiet for
+ *  			a second after its first byte, then checks the flash.
+ *
+ *  RETURNS: exit status
+ *
+ */
+static int SimServePty(const char *path) {
+	static uint8_t image[SIM_FLASH_SIZE];
+	struct pollfd pfd;
+	struct termios tio;
+	uint8_t buf[256];
+	uint32_t size;
+	uint32_t n;
+	int seen = 0;
+	int master;
+	int slave;
+	ssize_t len;
+	ssize_t i;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		printf("cannot open %s\n", path);
+		return 2;
+	}
+	memset(image, 0xFF, sizeof(image));
+	size = fread(image, 1, sizeof(image), f);
+	fclose(f);
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		printf("no pty\n");
+		return 2;
+	}
+	// held open so the master never sees a hang up between host sessions
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave >= 0 && tcgetattr(slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+	printf("%s\n", ptsname(master));
+	fflush(stdout);
+
+	memset(simFlash, 0xFF, sizeof(simFlash));
+	// no simulated clock here, the boot ROM listens at once
+	simTiming.bootTime = 0;
+	SimReset();
+	for (;;) {
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, seen ? 1000 : -1) == 0) {
+			break;
+		}
+		len = read(master, buf, sizeof(buf));
+		if (len <= 0) {
+			continue;
+		}
+		seen = 1;
+		for (i = 0; i < len; i++) {
+			// the pty carries any rate, host and target always agree
+			simHostBaud = simTargetBaud;
+			SimByte(buf[i]);
+		}
+		while (simOutTail != simOutHead) {
+			n = (simOutHead > simOutTail ? simOutHead : SIM_OUT_SIZE)
+					- simOutTail;
+			len = write(master, simOut + simOutTail, n);
+			if (len <= 0) {
+				break;
+			}
+			simOutTail = (simOutTail + len) % SIM_OUT_SIZE;
+		}
+	}
+
+	if (memcmp(simFlash, image, size) != 0) {
+		for (n = 0; n < size && simFlash[n] == image[n]; n++) {
+		}
+		printf("%s: flash differs from image at %u\n", ptsname(master), n);
+		return 1;
+	}
+	printf("%s: flash holds the image, %u commands\n", ptsname(master),
+			simStats.commands);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static uint8_t image[SIM_FLASH_SIZE];
+	uint32_t size = 65536;
+	uint32_t chunk = 4 * NUM_PARAMS_MAX;
+	uint32_t changed = 0;
+	uint32_t preload = 0;
+	uint32_t blank = 0;
+	uint32_t gap = 0;
+	uint32_t split;
+	uint32_t jobs = 1;
+	uint32_t dump = 0;
+	uint32_t overrun = 0;
+	double jobStart = 0;
+	double dumpUs = 0;
+	uint32_t i;
+	int opt;
+
+	for (opt = 1; opt + 1 < argc; opt += 2) {
+		double v = atof(argv[opt + 1]);
+		switch (argv[opt][1]) {
+		case 'y': return SimServePty(argv[opt + 1]);
+		case 's': size = (uint32_t) v; break;
+		case 'b': simLinkBaud = (uint32_t) v; break;
+		case 'l': simTiming.cmdLatency = v; break;
+		case 'e': simTiming.eraseTime = v; break;
+		case 'p': simTiming.programTime = v; break;
+		case 'r': simCorruptEvery = (uint32_t) v; break;
+		case 'o': preload = 1; changed = (uint32_t) v; break;
+		case 'f': blank = (uint32_t) v; break;
+		case 'c': chunk = (uint32_t) v; break;
+		case 'z': simCompress = (uint32_t) v; break;
+		case 'w': simWeakEvery = (uint32_t) v; break;
+		case 'k': simDropAt = (uint32_t) v; break;
+		case 'n': simRebuild = (uint32_t) v; break;
+		case 'a': simTiming.bootTime = v; break;
+		case 'j': jobs = (uint32_t) v; break;
+		case 'g': gap = (uint32_t) v; break;
+		case 'd': dump = (uint32_t) v; break;
+		case 'x': overrun = (uint32_t) v; break;
+		default:
+			printf("usage: %s [-s image bytes] [-b link baud] [-l cmd us]\n"
+					"  [-e erase us/sector] [-p program us/256 bytes]\n"
+					"  [-r resend every N] [-o preload,"
+					" change N bytes]\n  [-f blank tail bytes] [-c bytes per write]\n"
+					"  [-z 1, compressed writes] [-w weak C every N]\n"
+					"  [-k drop the link after N bytes and resume]\n"
+					"  [-n 1, rebuild the image while the link is down]\n"
+					"  [-a boot us after reset] [-j flash it N times]\n"
+					"  [-g gap bytes between two segments]\n"
+					"  [-d 1, dump the flash back afterwards]\n"
+					"  [-x 1, then a compressed stream past the end of flash]\n"
+					"  [-y image.bin, serve on a pty]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+	// the first segment ends a little way into a block
+	split = (size / 2) - (size / 2) % NXP_COPY_SIZE + 300;
+	if (size > SIM_FLASH_SIZE || (size % 4) != 0 || blank > size || chunk == 0
+			|| (chunk % 4) != 0 || (gap % 4) != 0
+			|| (gap != 0 && (simCompress || split + gap >= size))) {
+		printf("bad image size\n");
+		return 2;
+	}
+
+	srand(1);
+	for (i = 0; i < size; i++) {
+		image[i] = (i >= size - blank) ? 0xFF : rand() & 0xFF;
+	}
+	if (gap == 0) {
+		simPieces[0].start = 0;
+		simPieces[0].end = size;
+		simPieceCount = 1;
+	} else {
+		memset(image + split, 0xFF, gap);
+		simPieces[0].start = 0;
+		simPieces[0].end = split;
+		simPieces[1].start = split + gap;
+		simPieces[1].end = size;
+		simPieceCount = 2;
+		if ((split - 8) / NXP_COPY_SIZE == (split + gap) / NXP_COPY_SIZE) {
+			// the rest of the shared block, then the first segment's end
+			simPieces[0].end = split - 8;
+			simPieces[1].end = (split + gap) - (split + gap) % NXP_COPY_SIZE
+					+ NXP_COPY_SIZE;
+			if (simPieces[1].end > size) {
+				simPieces[1].end = size;
+			}
+			simPieces[2].start = split - 8;
+			simPieces[2].end = split;
+			simPieces[3].start = simPieces[1].end;
+			simPieces[3].end = size;
+			simPieceCount = 4;
+		}
+	}
+	memset(simFlash, 0xFF, sizeof(simFlash));
+	if (preload) {
+		memcpy(simFlash, image, size);
+		for (i = 0; i < changed; i++) {
+			simFlash[rand() % size] ^= 0x5A;
+		}
+	}
+	SimReset();
+
+	// later jobs find the NXP still in ISP mode
+	for (i = 0; i < jobs; i++) {
+		jobStart = simTimeUs;
+		if (SimFlashImage(image, size, chunk) != CMD_VALID) {
+			return 1;
+		}
+		simDropAt = 0;
+	}
+	if (memcmp(simFlash, image, size) != 0) {
+		for (i = 0; i < size && simFlash[i] == image[i]; i++) {
+		}
+		printf("flash differs from image at %u\n", i);
+		return 1;
+	}
+	if (simNestedTaken != 0) {
+		printf("%u NXP requests taken while busy\n", simNestedTaken);
+		return 1;
+	}
+	if (dump) {
+		dumpUs = simTimeUs;
+		if (SimDump(size) != CMD_VALID) {
+			return 1;
+		}
+		// kept out of the flashing time
+		dumpUs = simTimeUs - dumpUs;
+		simTimeUs -= dumpUs;
+	}
+
+	printf("image      %u bytes\n", size);
+	printf("baud       %u\n", simTargetBaud);
+	printf("time       %.3f s\n", simTimeUs / 1000000.0);
+	if (jobs > 1) {
+		printf("last job   %.3f s of %u\n", (simTimeUs - jobStart) / 1000000.0,
+				jobs);
+	}
+	printf("throughput %.0f bytes/s\n", size / (simTimeUs / 1000000.0));
+	if (dump) {
+		printf("dump       %.3f s, %.0f bytes/s, %u bytes handed out\n",
+				dumpUs / 1000000.0, size / (dumpUs / 1000000.0), simDumpBytes);
+	}
+	printf("over CAN   %u bytes\n", simCanBytes);
+	if (simResumedAt != 0) {
+		printf("resumed at %u\n", simResumedAt);
+	}
+	if (simStaleResumes != 0) {
+		printf("started over %u times, the image had changed\n",
+				simStaleResumes);
+	}
+	printf("to target  %llu bytes\n",
+			(unsigned long long) simStats.bytesToTarget);
+	printf("from target %llu bytes\n",
+			(unsigned long long) simStats.bytesFromTarget);
+	printf("commands   %u\n", simStats.commands);
+	printf("erases     %u\n", simStats.erases);
+	printf("copies     %u\n", simStats.copies);
+	printf("resends    %u\n", simStats.resends);
+	printf("idle calls %u\n", simIdleCalls);
+	SimPrintStats();
+	// after the figures above, it takes over the flash
+	if (overrun && SimLzOverrun(chunk) != CMD_VALID) {
+		return 1;
+	}
+	return 0;
+}